@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,80 +12,524 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Each hash bucket has its own lock, so lookups of different
+// blocks don't contend. Rather than keep an LRU list, which
+// would need a global lock, brelse() stamps each buffer with
+// the time it became unused, and bget() evicts the unused
+// buffer with the oldest stamp, taking it from whichever
+// bucket it is in.
+//
+// Buffers come in groups of BPERPG, whose data share one
+// kalloc()ed page. The cache starts with NBUF buffers, grows
+// by a group at a time while it is smaller than 1/BCACHEFRAC
+// of free memory, and gives groups back to kalloc() when free
+// memory shrinks, or when bshrink() asks.
+//
+// Building with BCACHE=2q replaces plain LRU eviction with the
+// scan-resistant 2Q policy (Johnson and Shasha, VLDB '94): a
+// block read for the first time goes in a FIFO queue, A1in,
+// which gets at most 1/4 of the buffers, so a long sequential
+// scan only recycles A1in's buffers. Blocks evicted from A1in
+// are remembered, without their data, in A1out; if one is read
+// again soon, it goes in the LRU queue Am, where blocks that are
+// used repeatedly (inodes, bitmaps, directories) live.
+//
+// bread_async() and bwrite_async() start disk I/O on a locked
+// buffer and return without waiting for it; bwait() waits.
+// A caller can so have many requests in the disk's queue at
+// once. bprefetch() starts reading a block and forgets about
+// it: the buffer stays locked, with a reference, while the read
+// is in flight, and the disk interrupt handler unlocks it, so a
+// bread() of the block meanwhile just waits.
 
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bstat.h"
+
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define BPERPG (PGSIZE / BSIZE)
+#define NPREFETCH 16   // bprefetch() submits this many at a time
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;     // buffers hashed here, through next
+  uint64 nhit;          // bget()s that found their block here
+  uint64 nmiss;         // bget()s that didn't
+};
+
+// The buffers whose data share a page.
+struct bgroup {
+  struct buf buf[BPERPG];
+  struct bgroup *next;  // bcache.groups or bcache.spare
+};
+
+#ifdef BCACHE_2Q
+#define NGHOST 1024    // most blocks remembered in A1out
+
+enum { A1IN, AM };
+
+#define KEY(b) ((b)->queue == A1IN ? (b)->intime : (b)->lastuse)
+#else
+#define KEY(b) ((b)->lastuse)
+#endif
 
 struct {
+  // Serializes evictions, which lock two buckets at once, and
+  // growing and shrinking, which lock a group's buckets; otherwise
+  // no one holds more than one bucket lock. Also protects:
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *free;       // buffers in no bucket, through next
+  struct bgroup *groups;  // groups with data pages
+  struct bgroup *spare;   // groups without
+  int nbuf;               // buffers with data pages
+  int nahead;             // bprefetch() reads in flight; atomic
+#ifdef BCACHE_2Q
+  int nin;                // buffers in A1in
+  struct {                // A1out: a ring, oldest at ghost[ghead]
+    uint dev;
+    uint blockno;
+  } ghost[NGHOST];
+  int ghead;
+  int nghost;
+#endif
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static int bgrow(void);
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+
+  // the log needs at least NBUF buffers.
+  acquire(&bcache.lock);
+  while(bcache.nbuf < NBUF)
+    if(bgrow() == 0)
+      panic("binit");
+  release(&bcache.lock);
+}
+
+// How many buffers the cache should have: 1/BCACHEFRAC of
+// the memory that is free or already in the cache.
+static int
+btarget(void)
+{
+  int n = (kfreecount() + bcache.nbuf / BPERPG) / BCACHEFRAC * BPERPG;
+
+  return n < NBUF ? NBUF : n;
+}
+
+// Add a group of buffers to bcache.free.
+// Returns 0 if out of memory. Caller holds bcache.lock.
+static int
+bgrow(void)
+{
+  struct bgroup *g;
+  struct buf *b;
+  char *pa;
+  int i;
+
+  if(bcache.spare == 0){
+    if((pa = kalloc()) == 0)
+      return 0;
+    for(i = 0; i < PGSIZE / sizeof(struct bgroup); i++){
+      g = (struct bgroup*)pa + i;
+      for(b = g->buf; b < g->buf+BPERPG; b++){
+        initsleeplock(&b->lock, "buffer");
+        b->group = g;
+        b->iodone = 0;
+      }
+      g->next = bcache.spare;
+      bcache.spare = g;
+    }
+  }
+  if((pa = kalloc()) == 0)
+    return 0;
+  g = bcache.spare;
+  bcache.spare = g->next;
+  g->next = bcache.groups;
+  bcache.groups = g;
+
+  for(i = 0; i < BPERPG; i++){
+    b = &g->buf[i];
+    b->data = (uchar*)pa + i*BSIZE;
+    b->refcnt = 0;
+    b->valid = 0;
+    b->hashed = 0;
+    b->lastuse = 0;
+    b->next = bcache.free;
+    bcache.free = b;
+  }
+  bcache.nbuf += BPERPG;
+  return 1;
+}
+
+// Give g's data page back to kalloc(), if none of its buffers
+// is in use. Returns 1 if it did. Caller holds bcache.lock.
+static int
+bfreegroup(struct bgroup *g)
+{
+  struct bucket *bk;
+  struct bgroup **gp;
+  struct buf *b, **pp;
+  int i, busy = 0;
+
+  // lock the buckets g's buffers are in, in bucket order.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    for(b = g->buf; b < g->buf+BPERPG; b++){
+      if(b->hashed && &bcache.bucket[BHASH(b->dev, b->blockno)] == bk){
+        acquire(&bk->lock);
+        break;
+      }
+    }
+  }
+  for(b = g->buf; b < g->buf+BPERPG; b++)
+    if(b->refcnt != 0)
+      busy = 1;
+
+  for(b = g->buf; !busy && b < g->buf+BPERPG; b++){
+    pp = b->hashed ? &bcache.bucket[BHASH(b->dev, b->blockno)].head : &bcache.free;
+    while(*pp != b)
+      pp = &(*pp)->next;
+    *pp = b->next;
+  }
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    if(holding(&bk->lock))
+      release(&bk->lock);
+  if(busy)
+    return 0;
+
+  for(i = 0; i < BPERPG; i++){
+#ifdef BCACHE_2Q
+    if(g->buf[i].hashed && g->buf[i].queue == A1IN)
+      bcache.nin--;
+#endif
+    g->buf[i].hashed = 0;
+  }
+  kfree((void*)PGROUNDDOWN((uint64)g->buf[0].data));
+  bcache.nbuf -= BPERPG;
+  for(gp = &bcache.groups; *gp != g; gp = &(*gp)->next)
+    ;
+  *gp = g->next;
+  g->next = bcache.spare;
+  bcache.spare = g;
+  return 1;
+}
+
+// Free the least recently used group of buffers that no one
+// is using, while the cache has more than min buffers.
+// Returns 1 if it freed one. Caller holds bcache.lock.
+static int
+bshrink1(int min)
+{
+  struct bgroup *g, *victim;
+  uint64 last, vlast = 0;
+  int i;
+
+  if(bcache.nbuf - BPERPG < min)
+    return 0;
+  // refcnt and lastuse are read without bucket locks;
+  // bfreegroup() checks again.
+  victim = 0;
+  for(g = bcache.groups; g; g = g->next){
+    last = 0;
+    for(i = 0; i < BPERPG; i++){
+      if(g->buf[i].refcnt != 0)
+        break;
+      if(g->buf[i].lastuse > last)
+        last = g->buf[i].lastuse;
+    }
+    if(i == BPERPG && (victim == 0 || last < vlast)){
+      victim = g;
+      vlast = last;
+    }
+  }
+  return victim != 0 && bfreegroup(victim);
+}
+
+// Memory is short: give back every unused group of buffers
+// beyond the first NBUF buffers. Returns how many pages
+// were freed. Must not be called holding bcache locks.
+int
+bshrink(void)
+{
+  int n = 0;
+
+  acquire(&bcache.lock);
+  while(bshrink1(NBUF))
+    n++;
+  release(&bcache.lock);
+  return n;
+}
+
+// Find the buffer for a block in bk, if cached, and take a
+// reference to it. Caller holds bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Take the unused buffer with the smallest KEY out of
+// whichever bucket it is in, considering only queue q under 2Q,
+// unless q < 0. Returns 0 if there is no such buffer.
+// Caller holds bcache.lock, and bk->lock.
+static struct buf*
+bpick(struct bucket *bk, int q)
+{
+  struct bucket *c, *vb;
+  struct buf *b, **pp, **vpp;
+  int better;
+
+  // Keep the lock on the bucket holding the best
+  // candidate so far, so it can't be taken meanwhile.
+  vb = 0;
+  vpp = 0;
+  for(c = bcache.bucket; c < bcache.bucket+NBUCKET; c++){
+    if(c != bk)
+      acquire(&c->lock);
+    better = 0;
+    for(pp = &c->head; (b = *pp) != 0; pp = &b->next){
+#ifdef BCACHE_2Q
+      if(q >= 0 && b->queue != q)
+        continue;
+#endif
+      if(b->refcnt == 0 && (vpp == 0 || KEY(b) < KEY(*vpp))){
+        vpp = pp;
+        better = 1;
+      }
+    }
+    if(better){
+      if(vb && vb != bk)
+        release(&vb->lock);
+      vb = c;
+    } else if(c != bk){
+      release(&c->lock);
+    }
+  }
+  if(vpp == 0)
+    return 0;
+
+  b = *vpp;
+  *vpp = b->next;
+  if(vb != bk)
+    release(&vb->lock);
+  return b;
+}
+
+#ifdef BCACHE_2Q
+// If block is in A1out, forget it there, and return 1.
+// Caller holds bcache.lock.
+static int
+bghost(uint dev, uint blockno)
+{
+  int i, j;
+
+  for(i = 0; i < bcache.nghost; i++){
+    j = (bcache.ghead + i) % NGHOST;
+    if(bcache.ghost[j].dev == dev && bcache.ghost[j].blockno == blockno){
+      bcache.ghost[j].dev = -1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Remember a block evicted from A1in in A1out, which
+// holds as many blocks as half the cache's buffers.
+// Caller holds bcache.lock.
+static void
+bremember(uint dev, uint blockno)
+{
+  int kout = bcache.nbuf / 2 < NGHOST ? bcache.nbuf / 2 : NGHOST;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  while(bcache.nghost > 0 && bcache.nghost >= kout){
+    bcache.ghead = (bcache.ghead + 1) % NGHOST;
+    bcache.nghost--;
   }
+  if(kout == 0)
+    return;
+  bcache.ghost[(bcache.ghead + bcache.nghost) % NGHOST].dev = dev;
+  bcache.ghost[(bcache.ghead + bcache.nghost) % NGHOST].blockno = blockno;
+  bcache.nghost++;
+}
+#endif
+
+// Take a buffer to recycle out of whichever bucket it is in:
+// the least recently used, or under 2Q, the oldest in A1in if
+// A1in has more than its share, else the least recently used
+// in Am. Returns 0 if every buffer is in use.
+// Caller holds bcache.lock, and bk->lock.
+static struct buf*
+bevict(struct bucket *bk)
+{
+#ifdef BCACHE_2Q
+  struct buf *b;
+
+  if((b = bpick(bk, bcache.nin > bcache.nbuf / 4 ? A1IN : AM)) == 0 &&
+     (b = bpick(bk, -1)) == 0)
+    return 0;
+  if(b->queue == A1IN){
+    bcache.nin--;
+    bremember(b->dev, b->blockno);
+  }
+  return b;
+#else
+  return bpick(bk, -1);
+#endif
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
+// In either case, return locked buffer; but if nowait is set,
+// return 0 for a block that is already cached rather than wait
+// for someone else to unlock it.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int nowait)
 {
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
   struct buf *b;
+  int target;
+#ifdef BCACHE_2Q
+  int q;
+#endif
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(nowait){
+      release(&bk->lock);
+      return 0;
     }
+    bk->nhit++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+
+  // Another process may have cached it while no lock was held.
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(!nowait)
+      bk->nhit++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    if(nowait)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+  bk->nmiss++;
+
+#ifdef BCACHE_2Q
+  // a block read again soon after it was evicted
+  // from A1in is probably going to be used again.
+  q = bghost(dev, blockno) ? AM : A1IN;
+#endif
+
+  // Grow the cache if it is below its share of memory,
+  // otherwise recycle the least recently used buffer.
+  target = btarget();
+  if(bcache.free == 0 && bcache.nbuf < target)
+    bgrow();
+  if(bcache.free == 0 && (b = bevict(bk)) == 0){
+    // every buffer is in use, e.g. locked for a batch of
+    // writes; go over the target rather than give up.
+    if(!bgrow())
+      panic("bget: no buffers");
+  }
+  if(bcache.free != 0){
+    b = bcache.free;
+    bcache.free = b->next;
+  }
+
+  b->next = bk->head;
+  bk->head = b;
+  b->hashed = 1;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+#ifdef BCACHE_2Q
+  b->queue = q;
+  if(q == A1IN){
+    bcache.nin++;
+    b->intime = *(uint64*)CLINT_MTIME;
   }
-  panic("bget: no buffers");
+#endif
+  release(&bk->lock);
+
+  // Free memory has shrunk; shrink along with it.
+  if(bcache.nbuf > target + BPERPG)
+    bshrink1(target);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Start I/O on the n locked bufs in b[], all for blocks on
+// the same device, in that device's driver.
+static void
+devsubmit(struct buf **b, int n, int write)
+{
+  if(n > 0 && b[0]->dev == RAMDISKDEV){
+    for(int i = 0; i < n; i++)
+      ramdiskrw(b[i], write);
+  } else {
+    virtio_disk_submitv(b, n, write);
+  }
+}
+
+// Wait for I/O that devsubmit() started on b to finish.
+static void
+devwait(struct buf *b)
+{
+  if(b->dev != RAMDISKDEV)
+    virtio_disk_wait(b);
+}
+
+// Return a locked buf for the indicated block, whose
+// contents may still be on their way from disk: call
+// bwait() before using them.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  if(!b->valid)
+    devsubmit(&b, 1, 0);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +538,168 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    devsubmit(&b, 1, 0);
+    devwait(b);
     b->valid = 1;
   }
   return b;
 }
 
+// Finish a bprefetch(): b's data has arrived.
+// Called by the disk driver's interrupt handler.
+static void
+bprefetched(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  b->iodone = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    b->lastuse = *(uint64*)CLINT_MTIME;
+  release(&bk->lock);
+  __atomic_fetch_sub(&bcache.nahead, 1, __ATOMIC_RELAXED);
+}
+
+// Start reading the n blocks in blocknos[] into the cache,
+// skipping those that are there already, and return without
+// waiting for them. Gives up if a quarter of the cache is
+// already being read ahead, so that read-ahead can't take
+// all the buffers.
+void
+bprefetch(uint dev, uint *blocknos, int n)
+{
+  struct buf *b, *bs[NPREFETCH];
+  int i, nb = 0;
+
+  for(i = 0; i < n; i++){
+    if(__atomic_load_n(&bcache.nahead, __ATOMIC_RELAXED) >= bcache.nbuf / 4)
+      break;
+    // skip cached blocks: waiting for one that someone has
+    // locked, while holding the unsubmitted bufs in bs[],
+    // could deadlock with them, e.g. with another bprefetch()
+    // going the other way. a newly allocated buf is unlocked.
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    __atomic_fetch_add(&bcache.nahead, 1, __ATOMIC_RELAXED);
+    disownsleep(&b->lock);
+    b->iodone = bprefetched;
+    bs[nb++] = b;
+    if(nb == NPREFETCH){
+      devsubmit(bs, nb, 0);
+      nb = 0;
+    }
+  }
+  devsubmit(bs, nb, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  devsubmit(&b, 1, 1);
+  devwait(b);
+}
+
+// Start writing b's contents to disk. Must be locked,
+// and stay locked until bwait(b) says it is written.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  devsubmit(&b, 1, 1);
+}
+
+// Start writing the n bufs in b[], all locked, to disk.
+// They must all be for blocks on the same device.
+// Those that hold consecutive blocks go to the disk
+// together. Call bwait() on each before using it again.
+void
+bwritev_async(struct buf **b, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev_async");
+  devsubmit(b, n, 1);
+}
+
+// Wait for the disk to finish a bread_async() or
+// bwrite_async() of b. Must be locked.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  devwait(b);
+  b->valid = 1;
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else is using it, note when it became unused.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b can't change buckets while we hold a reference.
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    b->lastuse = *(uint64*)CLINT_MTIME;
+  }
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Report hit and miss counts, the cache's size,
+// and how the disk's requests were completed.
+void
+bstat(struct bstat *st)
+{
+  struct bucket *bk;
 
+  st->nhit = st->nmiss = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    st->nhit += bk->nhit;
+    st->nmiss += bk->nmiss;
+    release(&bk->lock);
+  }
+  acquire(&bcache.lock);
+  st->nbuf = bcache.nbuf;
+  st->ntarget = btarget();
+  release(&bcache.lock);
+  virtio_disk_stat(st);
+}
@@ -0,0 +1,10 @@
+// Buffer cache and disk statistics, from bstat().
+struct bstat {
+  uint64 nhit;      // block lookups that found the block cached
+  uint64 nmiss;     // lookups that had to read it from disk
+  uint nbuf;        // buffers in the cache
+  uint ntarget;     // buffers it would grow to, given free memory
+  uint64 ndiskintr; // disk interrupts taken
+  uint64 nintrdone; // disk requests completed by the interrupt handler
+  uint64 npolldone; // disk requests completed by polling processes
+};
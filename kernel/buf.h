@@ -1,12 +1,23 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int diskq;   // virtqueue its I/O was submitted on
+  void (*iodone)(struct buf*); // if set, disk interrupt calls it when done
+  struct buf *qnext;  // waiting for the disk, in the elevator
+  int qwrite;         // to be written, rather than read
+  uint64 qdeadline;   // when it should have gone to the disk by
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  uint64 lastuse;   // when refcnt last fell to 0 (CLINT mtime)
+  int hashed;       // in a hash bucket, rather than free?
+#ifdef BCACHE_2Q
+  int queue;        // A1IN or AM
+  uint64 intime;    // when it entered A1IN (CLINT mtime)
+#endif
+  struct buf *next; // hash bucket chain, or free list
+  struct bgroup *group; // buffers sharing data's page
+  uchar *data;      // BSIZE bytes
 };
 
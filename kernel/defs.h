@@ -1,21 +1,34 @@
+struct bstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
 struct pipe;
+struct rcuhead;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct sleepstat;
 struct stat;
 struct superblock;
+struct vm;
+struct rastate;
+struct elevator;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_async(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
+void            bprefetch(uint, uint*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+void            bstat(struct bstat*);
 
 // console.c
 void            consoleinit(void);
@@ -42,27 +55,42 @@ struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilock_shared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            iunlock_shared(struct inode*);
 void            iupdate(struct inode*);
+void            iorphan(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, struct rastate*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            ncremove(struct inode*, char*);
+
+// rcu.c
+void            rcuinit(void);
+void            rcu_read_lock(void);
+void            rcu_read_unlock(void);
+void            rcu_retire(struct rcuhead*, void (*)(struct rcuhead*));
+
+// futex.c
+void            futexinit(void);
+int             futex(uint64, int, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+void            ramdiskrw(struct buf*, int);
 
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+int             kfreecount(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -82,10 +110,16 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+extern int      nrunnable;
+struct vm*      allocvm(void);
+int             clone(uint64, uint64, uint64);
 int             cpuid(void);
+void            dropvm(struct proc*);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+void            freevm(struct vm*);
+uint64          growproc(int);
+int             join(uint64);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -97,9 +131,11 @@ void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+void            tlbshootdown(struct vm*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -112,6 +148,8 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
+int             lockstat(uint64, int);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
@@ -121,6 +159,12 @@ void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            acquiresleep_shared(struct sleeplock*);
+void            releasesleep_shared(struct sleeplock*);
+int             holdingsleep_shared(struct sleeplock*);
+void            disownsleep(struct sleeplock*);
+void            sleeplockdump(void);
+void            sleepstat(struct sleepstat*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -145,6 +189,9 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            tickupdate(void);
+void            tickarm(uint);
+void            timerdefer(int);
 
 // uart.c
 void            uartinit(void);
@@ -157,6 +204,10 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmmapstack(uint64);
+void            kvmunmapstack(uint64);
+extern uint     kstackgen;
+pte_t *         walk(pagetable_t, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
@@ -177,10 +228,18 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// elevator.c
+void            elv_add(struct elevator*, struct buf*, int, uint64);
+int             elv_next(struct elevator*, struct buf**, int, int*, uint64);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+void            virtio_disk_stat(struct bstat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
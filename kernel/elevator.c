@@ -0,0 +1,110 @@
+//
+// Elevator: orders disk requests waiting for the device.
+//
+// The disk driver sends only so many requests to the device at
+// once; the rest wait here. elv_next() picks the next request
+// for the device, and merges the waiting bufs that follow it on
+// disk, in the same direction, into it. It serves requests in
+// ascending block order, from where the last one ended, and
+// then starts again from the lowest (C-SCAN), so that a stream
+// of requests near one spot can't starve others. A request that
+// has waited past its deadline, which is shorter for reads,
+// since someone is usually waiting for those, goes next anyway.
+//
+// Building with IOSCHED=noop sends requests in the order they
+// arrived, merging only those that arrived one after another.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "elevator.h"
+#include "defs.h"
+
+#define RDEADLINE 500000     // mtime units a read may wait: 50ms under qemu
+#define WDEADLINE 5000000    // and a write: 500ms
+
+#ifndef IOSCHED_NOOP
+// Does block (dev1, blockno1) come before (dev2, blockno2)
+// in the order the waiting list is sorted in?
+static int
+elv_before(uint dev1, uint blockno1, uint dev2, uint blockno2)
+{
+  return dev1 < dev2 || (dev1 == dev2 && blockno1 < blockno2);
+}
+#endif
+
+// Add b, to be read or written, to the waiting requests.
+void
+elv_add(struct elevator *e, struct buf *b, int write, uint64 now)
+{
+  struct buf **pp;
+
+  b->qwrite = write;
+  b->qdeadline = now + (write ? WDEADLINE : RDEADLINE);
+#ifdef IOSCHED_NOOP
+  for(pp = &e->head; *pp; pp = &(*pp)->qnext)
+    ;
+#else
+  for(pp = &e->head; *pp; pp = &(*pp)->qnext)
+    if(elv_before(b->dev, b->blockno, (*pp)->dev, (*pp)->blockno))
+      break;
+#endif
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Take the next request for the device off the waiting list:
+// up to max bufs for consecutive blocks, all to be read or all
+// written. Put them in b[], and the direction in *write, and
+// return how many there are, or 0 if nothing is waiting.
+int
+elv_next(struct elevator *e, struct buf **b, int max, int *write, uint64 now)
+{
+  struct buf **pp, **start, *x;
+  int n;
+
+  if(e->head == 0)
+    return 0;
+
+  start = &e->head;
+#ifndef IOSCHED_NOOP
+  // the most overdue request, if any is overdue; else
+  // the first at or after (posdev, pos), wrapping around.
+  struct buf **late = 0;
+  for(pp = &e->head; *pp; pp = &(*pp)->qnext)
+    if((*pp)->qdeadline <= now && (late == 0 || (*pp)->qdeadline < (*late)->qdeadline))
+      late = pp;
+  if(late){
+    start = late;
+  } else {
+    for(pp = &e->head; *pp; pp = &(*pp)->qnext){
+      if(!elv_before((*pp)->dev, (*pp)->blockno, e->posdev, e->pos)){
+        start = pp;
+        break;
+      }
+    }
+  }
+#endif
+
+  // take the request at *start, and those after it in the
+  // list that continue it on disk.
+  *write = (*start)->qwrite;
+  n = 0;
+  pp = start;
+  while((x = *pp) != 0 && n < max){
+    if(n > 0 && (x->dev != b[0]->dev || x->blockno != b[n-1]->blockno + 1 ||
+                 x->qwrite != *write))
+      break;
+    *pp = x->qnext;
+    x->qnext = 0;
+    b[n++] = x;
+  }
+  e->posdev = b[n-1]->dev;
+  e->pos = b[n-1]->blockno + 1;
+  return n;
+}
@@ -0,0 +1,8 @@
+// Disk requests waiting to go to the device, in the order the
+// elevator will send them. See elevator.c. The disk driver owns
+// one, and locks it with its own lock.
+struct elevator {
+  struct buf *head;   // waiting bufs, sorted by (dev, block), through qnext
+  uint posdev;        // dev of the last request sent to the device
+  uint pos;           // and the block after its last one
+};
@@ -118,10 +118,22 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // readers of the inode can share its lock. but if other
+    // processes have f open too, the exclusive lock also
+    // keeps their reads of f->off from interleaving with ours.
+    if(f->ref == 1){
+      ilock_shared(f->ip);
+      readahead(f->ip, &f->ra, f->off, n);
+      if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+        f->off += r;
+      iunlock_shared(f->ip);
+    } else {
+      ilock(f->ip);
+      readahead(f->ip, &f->ra, f->off, n);
+      if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+    }
   } else {
     panic("fileread");
   }
@@ -148,11 +160,13 @@ filewrite(struct file *f, uint64 addr, int n)
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // i-node and 1 block of slop for non-aligned writes.
+    // writei() writes less if the blocks it adds to the
+    // file need more allocation and extent blocks than
+    // are left; the next transaction writes the rest.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (MAXOPBLOCKS-1-1-1) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -166,7 +180,7 @@ filewrite(struct file *f, uint64 addr, int n)
       iunlock(f->ip);
       end_op();
 
-      if(r != n1){
+      if(r <= 0){
         // error from writei
         break;
       }
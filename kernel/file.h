@@ -1,3 +1,10 @@
+// Sequential read detection, per open file.
+struct rastate {
+  uint next;    // offset at which a sequential read would start
+  uint win;     // blocks to read ahead; 0 if reads aren't sequential
+  uint end;     // block after the last one read ahead
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
   int ref; // reference count
@@ -6,6 +13,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  struct rastate ra; // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -26,7 +34,14 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint depth;
+  struct extent ext[NEXTENT];
+
+  struct spinlock xlock; // protects the below, as readers share lock
+  struct extent xcache;  // extent bmap() found last, if len > 0
+  uint xbase;            // file block at which xcache starts
+  struct extent xleaf;   // index entry for the extent block it was in
+  uint xleafbase;        // file block at which xleaf starts
 };
 
 // map major device number to device functions.
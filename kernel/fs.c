@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "rcu.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -37,6 +38,9 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bmapinit(int);
+static void iorphanfree(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +48,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bmapinit(dev);
+  iorphanfree(dev);
 }
 
 // Zero a block.
@@ -59,47 +65,216 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// Each bitmap block covers a group of BPB blocks. For every
+// group, bmapgroup remembers how many of its blocks are free
+// and the lowest one that might be, so balloc() can skip full
+// groups without reading their bitmap block, and it scans the
+// bitmap a 64-bit word at a time. balloc() takes a goal, the
+// block that would best come next, usually the one after the
+// previous block of the file, so that files stay contiguous
+// and read-ahead and the log move them in few disk requests.
+//
+// A group's counts change only with its bitmap block's buf
+// locked; balloc() reads nfree without that lock, but only as
+// a hint of which groups to skip. The counts live in pages
+// that bmapinit() allocates to suit the file system's size,
+// GPP groups to a page.
+
+struct bgroupinfo {
+  int nfree;    // free blocks in the group
+  uint first;   // no block in the group below this one is free
+};
+
+#define GPP (PGSIZE / sizeof(struct bgroupinfo))
+#define BGROUP(g) (bmapgroup[(g) / GPP][(g) % GPP])
+
+// enough pages for 2^32 blocks.
+static struct bgroupinfo *bmapgroup[(1UL << 32) / BPB / GPP];
+static int nbmapgroup;
+
+// Return the lowest free block in [from, to) of the group
+// whose bitmap block holds data, or -1.
+static int
+bfirstfree(uchar *data, int from, int to)
+{
+  uint64 *w = (uint64*)data;
+  uint64 x;
+  int i, bi;
+
+  for(i = from / 64; i * 64 < to; i++){
+    x = ~w[i];
+    if(i == from / 64)
+      x &= ~0ULL << (from % 64);
+    if(x == 0)
+      continue;
+    bi = i * 64;
+    while((x & 0xff) == 0){
+      x >>= 8;
+      bi += 8;
+    }
+    while((x & 1) == 0){
+      x >>= 1;
+      bi++;
+    }
+    return bi < to ? bi : -1;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Number of blocks covered by group g.
+static int
+bgroupsize(int g)
 {
-  int b, bi, m;
-  struct buf *bp;
+  return min(BPB, sb.size - g * BPB);
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+// Number of bits set in x.
+static int
+popcount(uint64 x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// Count the free blocks in each group. Called once, after
+// log recovery has brought the bitmap up to date. Reads the
+// bitmap 16 blocks ahead, so that a large file system's
+// bitmap arrives in a few large disk requests.
+static void
+bmapinit(int dev)
+{
+  struct buf *bp;
+  uint64 *w;
+  uint blocks[16];
+  int g, i, n;
+
+  nbmapgroup = (sb.size + BPB - 1) / BPB;
+  for(g = 0; g < nbmapgroup; g += GPP){
+    if((bmapgroup[g / GPP] = (struct bgroupinfo*)kalloc()) == 0)
+      panic("bmapinit: kalloc");
+  }
+  for(g = 0; g < nbmapgroup; g++){
+    if(g % NELEM(blocks) == 0){
+      for(i = 0; i < NELEM(blocks) && g + i < nbmapgroup; i++)
+        blocks[i] = sb.bmapstart + g + i;
+      bprefetch(dev, blocks, i);
     }
+    bp = bread(dev, sb.bmapstart + g);
+    w = (uint64*)bp->data;
+    n = bgroupsize(g);
+    BGROUP(g).nfree = 0;
+    for(i = 0; i < n / 64; i++)
+      BGROUP(g).nfree += 64 - popcount(w[i]);
+    if(n % 64)
+      BGROUP(g).nfree += popcount(~w[i] & ((1ULL << (n % 64)) - 1));
+    i = bfirstfree(bp->data, 0, n);
+    BGROUP(g).first = i < 0 ? n : i;
     brelse(bp);
   }
-  panic("balloc: out of blocks");
 }
 
-// Free a disk block.
-static void
-bfree(int dev, uint b)
+// Allocate a run of up to max free blocks in group g,
+// starting at or after the group's block goal if possible,
+// else at the lowest free one. Sets *n to the run's length
+// and returns its first block, or 0 if the group is full.
+static uint
+ballocgroup(uint dev, int g, int goal, uint max, uint *n)
 {
   struct buf *bp;
-  int bi, m;
-
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
+  int bi, k, size;
+
+  if(BGROUP(g).nfree == 0)
+    return 0;
+  bp = bread(dev, sb.bmapstart + g);
+  size = bgroupsize(g);
+  bi = -1;
+  if(BGROUP(g).nfree > 0){
+    if(goal > BGROUP(g).first)
+      bi = bfirstfree(bp->data, goal, size);
+    if(bi < 0)
+      bi = bfirstfree(bp->data, BGROUP(g).first, size);
+  }
+  if(bi < 0){
+    brelse(bp);
+    return 0;
+  }
+  for(k = 0; k < max && bi + k < size; k++){
+    if(bp->data[(bi+k)/8] & (1 << ((bi+k) % 8)))
+      break;
+    bp->data[(bi+k)/8] |= 1 << ((bi+k) % 8);  // Mark block in use.
+  }
   log_write(bp);
+  BGROUP(g).nfree -= k;
+  if(bi == BGROUP(g).first)
+    BGROUP(g).first = bi + k;
   brelse(bp);
+  *n = k;
+  return g * BPB + bi;
+}
+
+// Allocate a run of up to max zeroed disk blocks, starting
+// as near after goal as possible; goal 0 means the lowest
+// free block will do. Sets *n to the run's length, which is
+// at least 1, and returns its first block.
+static uint
+ballocrun(uint dev, uint goal, uint max, uint *n)
+{
+  int i, g;
+  uint b, k;
+
+  if(goal >= sb.size)
+    goal = 0;
+  g = goal / BPB;
+  if((b = ballocgroup(dev, g, goal % BPB, max, n)) == 0){
+    for(i = 0; i < nbmapgroup; i++){
+      g = goal ? (goal / BPB + i + 1) % nbmapgroup : i;
+      if((b = ballocgroup(dev, g, 0, max, n)) != 0)
+        break;
+    }
+  }
+  if(b == 0)
+    panic("balloc: out of blocks");
+  for(k = 0; k < *n; k++)
+    bzero(dev, b + k);
+  return b;
+}
+
+// Allocate a zeroed disk block, as near after goal as
+// possible.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint n;
+
+  return ballocrun(dev, goal, 1, &n);
+}
+
+// Free the n disk blocks starting at b.
+static void
+bfree(int dev, uint b, uint n)
+{
+  struct buf *bp;
+  int bi, g, m;
+
+  while(n > 0){
+    g = b / BPB;
+    bp = bread(dev, BBLOCK(b, sb));
+    for(; n > 0 && b / BPB == g; b++, n--){
+      bi = b % BPB;
+      m = 1 << (bi % 8);
+      if((bp->data[bi/8] & m) == 0)
+        panic("freeing free block");
+      bp->data[bi/8] &= ~m;
+      BGROUP(g).nfree++;
+      if(bi < BGROUP(g).first)
+        BGROUP(g).first = bi;
+    }
+    log_write(bp);
+    brelse(bp);
+  }
 }
 
 // Inodes.
@@ -143,6 +318,9 @@ bfree(int dev, uint b)
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
 //   has first locked the inode.
+//   Code that only examines them, such as path lookup
+//   and read(), can use ilock_shared() instead, so that
+//   concurrent readers don't wait for each other.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -176,14 +354,69 @@ struct {
   struct inode inode[NINODE];
 } itable;
 
+// ialloc() starts looking for a free inode at ifree.next, so
+// that it doesn't read every inode block before the first
+// free inode on a large file system each time.
+struct {
+  struct spinlock lock;
+  uint next;   // no inode below this one is free
+  uint seq;    // bumped by each iput() that frees an inode,
+               // so ialloc() knows not to raise next past it
+} ifree;
+
+// Inodes that have no links but haven't been freed yet, because
+// they are still open or because itrunc() is freeing their blocks
+// over several transactions, are kept on a list on disk: from
+// sb.orphan through each dinode's next. sys_unlink() adds an inode
+// in the transaction that removes its last link, and iput() takes
+// it off in the one that frees it, so that after a crash fsinit()
+// can finish freeing whatever is left on the list.
+// orphanlock protects the list and sb.orphan.
+static struct sleeplock orphanlock;
+
+// Name cache: maps (dev, directory inum, name) to the inum
+// of directory entries that path lookups have found, so that
+// namei() can walk cached paths without locking anything (see
+// rcu.c), falling back to namex() at the first miss. Entries
+// are added with the directory locked, and unlink() removes
+// them with the directory locked exclusively, so the cache
+// never holds a name the directory doesn't. "." and ".." are
+// not cached, since removing a directory would leave its ".."
+// entry behind.
+
+#define NNCHASH 64   // hash buckets
+#define NNCACHE 512  // most entries cached
+
+struct ncentry {
+  struct rcuhead rcu;
+  struct ncentry *next;  // hash chain, read without ncache.lock
+  uint dev;
+  uint dinum;            // directory
+  uint inum;             // what name refers to in the directory
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;  // protects changes to the cache
+  struct ncentry *hash[NNCHASH];
+  struct ncentry *free;  // entries from kalloc()ed pages
+  int n;                 // entries in hash[]
+  uint seq;              // bumped by each removal
+} ncache;
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
+  initlock(&ncache.lock, "ncache");
+  initlock(&ifree.lock, "ifree");
+  initsleeplock(&orphanlock, "orphan");
+  ifree.next = 1;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    initlock(&itable.inode[i].xlock, "xcache");
   }
 }
 
@@ -195,21 +428,39 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum, start, seq, blk;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
+  acquire(&ifree.lock);
+  start = ifree.next;
+  seq = ifree.seq;
+  release(&ifree.lock);
+
+  for(;;){
+    for(inum = start; inum < sb.ninodes; ){
+      blk = IBLOCK(inum, sb);
+      bp = bread(dev, blk);
+      for(; inum < sb.ninodes && IBLOCK(inum, sb) == blk; inum++){
+        dip = (struct dinode*)bp->data + inum%IPB;
+        if(dip->type == 0){  // a free inode
+          memset(dip, 0, sizeof(*dip));
+          dip->type = type;
+          log_write(bp);   // mark it allocated on the disk
+          brelse(bp);
+          acquire(&ifree.lock);
+          if(ifree.seq == seq && ifree.next < inum + 1)
+            ifree.next = inum + 1;
+          release(&ifree.lock);
+          return iget(dev, inum);
+        }
+      }
       brelse(bp);
-      return iget(dev, inum);
     }
-    brelse(bp);
+    // an inode below start may have been freed since.
+    if(start == 1)
+      break;
+    start = 1;
   }
   panic("ialloc: no inodes");
 }
@@ -231,7 +482,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->depth = ip->depth;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
   log_write(bp);
   brelse(bp);
 }
@@ -304,7 +556,10 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->depth = dip->depth;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->xcache.len = 0;
+    ip->xleaf.len = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -312,6 +567,36 @@ ilock(struct inode *ip)
   }
 }
 
+// Lock the given inode for reading, shared with other readers.
+// Callers must not modify the inode or its contents.
+void
+ilock_shared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilock_shared");
+
+  acquiresleep_shared(&ip->lock);
+
+  // reading the inode from disk needs the exclusive lock.
+  // once valid, it stays so as long as we hold a reference.
+  if(ip->valid == 0){
+    releasesleep_shared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleep_shared(&ip->lock);
+  }
+}
+
+// Unlock an inode locked with ilock_shared().
+void
+iunlock_shared(struct inode *ip)
+{
+  if(ip == 0 || !holdingsleep_shared(&ip->lock) || ip->ref < 1)
+    panic("iunlock_shared");
+
+  releasesleep_shared(&ip->lock);
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -322,6 +607,70 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Set the orphan list link of inode inum on disk to next,
+// or the head of the list if inum is 0.
+static void
+orphanset(uint dev, uint inum, uint next)
+{
+  struct buf *bp;
+
+  if(inum == 0){
+    bp = bread(dev, 1);
+    ((struct superblock*)bp->data)->orphan = next;
+    sb.orphan = next;
+  } else {
+    bp = bread(dev, IBLOCK(inum, sb));
+    ((struct dinode*)bp->data + inum%IPB)->next = next;
+  }
+  log_write(bp);
+  brelse(bp);
+}
+
+// The inode after inum on the orphan list.
+static uint
+orphannext(uint dev, uint inum)
+{
+  struct buf *bp;
+  uint next;
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  next = ((struct dinode*)bp->data + inum%IPB)->next;
+  brelse(bp);
+  return next;
+}
+
+// Put ip, whose last link is being removed, on the orphan list.
+// Caller must hold ip->lock, inside a transaction.
+// Logs ip's inode block and the superblock.
+void
+iorphan(struct inode *ip)
+{
+  acquiresleep(&orphanlock);
+  orphanset(ip->dev, ip->inum, sb.orphan);
+  orphanset(ip->dev, 0, ip->inum);
+  releasesleep(&orphanlock);
+}
+
+// Take ip off the orphan list.
+// Caller must hold ip->lock, inside a transaction.
+// Logs ip's inode block and one other block.
+static void
+iunorphan(struct inode *ip)
+{
+  uint prev, inum;
+
+  acquiresleep(&orphanlock);
+  prev = 0;
+  for(inum = sb.orphan; inum != ip->inum; inum = orphannext(ip->dev, inum)){
+    if(inum == 0)
+      panic("iunorphan");
+    prev = inum;
+  }
+  orphanset(ip->dev, prev, orphannext(ip->dev, ip->inum));
+  orphanset(ip->dev, ip->inum, 0);
+  releasesleep(&orphanlock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -343,11 +692,22 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    // it may be a directory unlinked while in use
+    // (e.g. as a cwd), with names created in it since.
+    if(ip->type == T_DIR)
+      ncremove(ip, 0);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    iunorphan(ip);
     ip->valid = 0;
 
+    acquire(&ifree.lock);
+    if(ip->inum < ifree.next)
+      ifree.next = ip->inum;
+    ifree.seq++;
+    release(&ifree.lock);
+
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
@@ -357,6 +717,24 @@ iput(struct inode *ip)
   release(&itable.lock);
 }
 
+// Free the inodes left on the orphan list by a crash.
+static void
+iorphanfree(int dev)
+{
+  struct inode *ip;
+
+  while(sb.orphan != 0){
+    begin_op();
+    ip = iget(dev, sb.orphan);
+    ilock(ip);
+    if(ip->nlink != 0)
+      panic("iorphanfree");
+    iunlock(ip);
+    iput(ip);  // frees it and takes it off the list
+    end_op();
+  }
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -368,72 +746,317 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, as a sequence of extents. Up to
+// NEXTENT extents are listed in ip->ext[]; beyond that,
+// ip->ext[] indexes extent blocks, ip->depth levels deep:
+// one level is like an indirect block, two a double-
+// indirect block, three a triple-indirect block.
+// writei() allocates blocks in runs just after the file's
+// last block, so that a file usually has few extents.
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If run is not 0, set *run to the number of blocks that
+// follow it on the disk, in the same extent.
+// The extent found, and the extent block it was in, are
+// remembered in ip->xcache and ip->xleaf, so that sequential
+// access reads no extent blocks until it moves on to the
+// next extent, and then only that one extent block until it
+// moves on to the next. Appending to the file only makes the
+// cached entries longer, and itrunc() forgets them.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, uint *run)
 {
-  uint addr, *a;
+  struct extent *e, x, leaf;
   struct buf *bp;
+  uint base, leafbase, off;
+  int d, i, n;
+
+  acquire(&ip->xlock);
+  x = ip->xcache;
+  base = ip->xbase;
+  leaf = ip->xleaf;
+  leafbase = ip->xleafbase;
+  release(&ip->xlock);
+
+  if(bn < base || bn - base >= x.len){
+    e = ip->ext;
+    n = NEXTENT;
+    d = ip->depth;
+    bp = 0;
+    off = bn;
+    if(d > 0 && bn >= leafbase && bn - leafbase < leaf.len){
+      bp = bread(ip->dev, leaf.addr);
+      e = (struct extent*)bp->data;
+      n = NXPB;
+      d = 0;
+      off = bn - leafbase;
+    }
+    for(; ; d--){
+      for(i = 0; i < n && e[i].len > 0 && off >= e[i].len; i++)
+        off -= e[i].len;
+      if(i == n || e[i].len == 0)
+        panic("bmap: out of range");
+      x = e[i];
+      if(bp)
+        brelse(bp);
+      if(d == 0)
+        break;
+      if(d == 1){
+        leaf = x;
+        leafbase = bn - off;
+      }
+      bp = bread(ip->dev, x.addr);
+      e = (struct extent*)bp->data;
+      n = NXPB;
+    }
+    base = bn - off;
+    acquire(&ip->xlock);
+    ip->xcache = x;
+    ip->xbase = base;
+    ip->xleaf = leaf;
+    ip->xleafbase = leafbase;
+    release(&ip->xlock);
+  }
+
+  if(run)
+    *run = x.len - (bn - base) - 1;
+  return x.addr + (bn - base);
+}
+
+// Number of blocks the file has, given its top-level
+// extents e[0..n).
+static uint
+xblocks(struct extent *e, int n)
+{
+  uint nb;
+  int i;
+
+  nb = 0;
+  for(i = 0; i < n && e[i].len > 0; i++)
+    nb += e[i].len;
+  return nb;
+}
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
-  }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+static int xappendblk(uint dev, uint blockno, int depth, uint addr, uint len);
+
+// Append the run of len blocks at addr to the extents
+// e[0..n), of the given depth. Returns -1 if they are full.
+static int
+xappend(uint dev, struct extent *e, int n, int depth, uint addr, uint len)
+{
+  int i;
+
+  for(i = 0; i < n && e[i].len > 0; i++)
+    ;
+  if(depth == 0 && i > 0 && e[i-1].addr + e[i-1].len == addr){
+    // extend the last extent.
+    e[i-1].len += len;
+  } else if(depth > 0 && i > 0 &&
+            xappendblk(dev, e[i-1].addr, depth-1, addr, len) == 0){
+    e[i-1].len += len;
+  } else if(i < n){
+    e[i].addr = addr;
+    e[i].len = len;
+    if(depth > 0){
+      // start a new, empty extent block.
+      e[i].addr = balloc(dev, 0);
+      if(xappendblk(dev, e[i].addr, depth-1, addr, len) < 0)
+        panic("xappend");
     }
-    brelse(bp);
-    return addr;
+  } else {
+    return -1;
   }
+  return 0;
+}
+
+// Append to the extents of the given depth in extent
+// block blockno.
+static int
+xappendblk(uint dev, uint blockno, int depth, uint addr, uint len)
+{
+  struct buf *bp;
+  int r;
 
-  panic("bmap: out of range");
+  bp = bread(dev, blockno);
+  r = xappend(dev, (struct extent*)bp->data, NXPB, depth, addr, len);
+  if(r == 0)
+    log_write(bp);
+  brelse(bp);
+  return r;
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Append the run of len blocks at addr to ip's content,
+// making its extent tree a level deeper if it is full.
+// Returns -1 if the tree is as deep as it can be.
+static int
+iappend(struct inode *ip, uint addr, uint len)
 {
-  int i, j;
   struct buf *bp;
-  uint *a;
+  uint b, nb;
+
+  while(xappend(ip->dev, ip->ext, NEXTENT, ip->depth, addr, len) < 0){
+    if(ip->depth == MAXDEPTH)
+      return -1;
+    // move ip->ext[] down into a new extent block, and
+    // make it the only entry in ip->ext[].
+    b = balloc(ip->dev, 0);
+    bp = bread(ip->dev, b);
+    memmove(bp->data, ip->ext, sizeof(ip->ext));
+    log_write(bp);
+    brelse(bp);
+    nb = xblocks(ip->ext, NEXTENT);
+    memset(ip->ext, 0, sizeof(ip->ext));
+    ip->ext[0].addr = b;
+    ip->ext[0].len = nb;
+    ip->depth++;
+  }
+  return 0;
+}
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+// Give ip at least nb blocks, allocating them in runs
+// that continue from its last block where the disk allows,
+// and logging at most max blocks. Returns how many blocks
+// ip has, less than nb if its extent tree is full or if the
+// rest would need more than max.
+static uint
+iextend(struct inode *ip, uint nb, int max)
+{
+  uint have, addr, goal, n;
+
+  // the extent blocks on the tree's right edge, and up to
+  // depth+1 new ones (if the tree deepens) and their bitmap
+  // blocks; a write adds far fewer than NXPB extents, so
+  // these are only needed once. each run then logs its
+  // bitmap block and its blocks, which balloc() zeroes.
+  max -= ip->depth + 2*min(ip->depth + 1, MAXDEPTH);
+  have = xblocks(ip->ext, NEXTENT);
+  while(have < nb && max > 1){
+    goal = have > 0 ? bmap(ip, have - 1, 0) + 1 : 0;
+    addr = ballocrun(ip->dev, goal, min(nb - have, max - 1), &n);
+    if(iappend(ip, addr, n) < 0){
+      bfree(ip->dev, addr, n);
+      break;
     }
+    have += n;
+    max -= 1 + n;
   }
+  return have;
+}
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
+// Blocks that one step of itrunc() has logged, so that it
+// can end its transaction before logging more than one
+// transaction may.
+struct tblocks {
+  uint blockno[MAXOPBLOCKS];
+  int n;
+};
+
+static void
+tnote(struct tblocks *t, uint blockno)
+{
+  int i;
+
+  for(i = 0; i < t->n; i++)
+    if(t->blockno[i] == blockno)
+      return;
+  if(t->n == NELEM(t->blockno))
+    panic("tnote");
+  t->blockno[t->n++] = blockno;
+}
+
+// Remove up to max blocks from the end of the file whose
+// top-level extents are e[0..n), of the given depth, all of
+// them within one bitmap group. Sets *addr to the first and
+// returns how many, for the caller to free. Frees extent
+// blocks that this leaves empty. Notes in t each block it
+// logs, at most 2*depth of them.
+static uint
+xpop(uint dev, struct extent *e, int n, int depth, uint max,
+     uint *addr, struct tblocks *t)
+{
+  struct buf *bp;
+  uint k, last;
+  int i;
+
+  for(i = n; i > 0 && e[i-1].len == 0; i--)
+    ;
+  if(i-- == 0)
+    return 0;
+  if(depth == 0){
+    last = e[i].addr + e[i].len - 1;
+    k = min(max, e[i].len);
+    k = min(k, last % BPB + 1);
+    *addr = last - k + 1;
+  } else {
+    bp = bread(dev, e[i].addr);
+    k = xpop(dev, (struct extent*)bp->data, NXPB, depth-1, max, addr, t);
+    log_write(bp);
+    tnote(t, e[i].addr);
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  e[i].len -= k;
+  if(e[i].len == 0){
+    if(depth > 0){
+      bfree(dev, e[i].addr, 1);
+      tnote(t, BBLOCK(e[i].addr, sb));
+    }
+    e[i].addr = 0;
+  }
+  return k;
+}
+
+// Blocks a caller may log in its transaction before itrunc():
+// sys_unlink() logs a directory block, the directory's and
+// the file's inode blocks, and the superblock.
+#define ITRUNCCALLER 4
+
+// Truncate inode (discard contents).
+// Caller must hold ip->lock, inside a transaction, and no
+// other inode's lock. A large or fragmented file's blocks
+// span more bitmap and extent blocks than one transaction
+// may log, so itrunc() frees them from the end in steps, and
+// between steps unlocks ip and ends the transaction and
+// begins another. The file is empty from the first step on;
+// should someone write to it meanwhile, the later steps free
+// only the blocks past its new size. A crash between steps
+// leaves a linked file with blocks past its size, which
+// writes reuse and the next itrunc() frees, and an unlinked
+// one on the orphan list, for fsinit() to finish freeing.
+void
+itrunc(struct inode *ip)
+{
+  struct tblocks t;
+  uint nb, keep, addr, k;
+  int avail;
 
   ip->size = 0;
-  iupdate(ip);
+  avail = MAXOPBLOCKS - ITRUNCCALLER;
+  for(;;){
+    keep = (ip->size + BSIZE - 1) / BSIZE;
+    nb = xblocks(ip->ext, NEXTENT);
+    // leave room for the inode block and iput()'s orphan
+    // list update; each xpop() logs at most 2*depth extent
+    // blocks, and its run's bitmap block.
+    t.n = 0;
+    while(nb > keep && t.n + 2*ip->depth + 1 <= avail - 2){
+      k = xpop(ip->dev, ip->ext, NEXTENT, ip->depth, nb - keep, &addr, &t);
+      bfree(ip->dev, addr, k);
+      tnote(&t, BBLOCK(addr, sb));
+      nb -= k;
+    }
+    if(nb == 0)
+      ip->depth = 0;
+    ip->xcache.len = 0;
+    ip->xleaf.len = 0;
+    iupdate(ip);
+    if(nb <= keep)
+      break;
+    iunlock(ip);
+    end_op();
+    begin_op();
+    ilock(ip);
+    avail = MAXOPBLOCKS;
+  }
 }
 
 // Copy stat information from inode.
@@ -464,7 +1087,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 0));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -476,17 +1099,82 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Note a read of n bytes at off from an open file whose
+// read-ahead state is ra. If it continues a sequential run of
+// reads, start reading the blocks it needs and the window of
+// blocks after them into the buffer cache, without waiting.
+// The window starts at 4 blocks and doubles with each further
+// sequential read, up to READAHEAD. Any other read resets it.
+// Caller must hold ip->lock, shared or not, and ra's file
+// must not be read by anyone else meanwhile.
+void
+readahead(struct inode *ip, struct rastate *ra, uint off, uint n)
+{
+  uint bn, end, nblock, addr, run, blocks[16];
+  int n1 = 0;
+
+  if(off != ra->next){
+    ra->win = 0;
+    ra->end = 0;
+  } else if(ra->win == 0){
+    ra->win = READAHEAD < 4 ? READAHEAD : 4;
+  } else if(ra->win < READAHEAD){
+    ra->win = ra->win * 2 < READAHEAD ? ra->win * 2 : READAHEAD;
+  }
+  ra->next = off + n;
+
+  if(ra->win == 0 || n == 0 || off >= ip->size)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+
+  // start with this read's own blocks, so that they
+  // are all in flight before readi() waits for the first;
+  // skip those that earlier calls have already asked for.
+  nblock = (ip->size + BSIZE - 1) / BSIZE;
+  end = (off + n - 1) / BSIZE + 1 + ra->win;
+  if(end > nblock)
+    end = nblock;
+  bn = off / BSIZE;
+  if(ra->end > bn)
+    bn = ra->end;
+  // look blocks up in the extent tree only at the start
+  // of each extent.
+  addr = run = 0;
+  for(; bn < end; bn++){
+    if(run > 0){
+      addr++;
+      run--;
+    } else {
+      addr = bmap(ip, bn, &run);
+    }
+    blocks[n1++] = addr;
+    if(n1 == NELEM(blocks)){
+      bprefetch(ip->dev, blocks, n1);
+      n1 = 0;
+    }
+  }
+  bprefetch(ip->dev, blocks, n1);
+  ra->end = end;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
-// Returns the number of bytes successfully written.
-// If the return value is less than the requested n,
-// there was an error of some kind.
+// Returns the number of bytes successfully written. That is
+// less than n if the blocks the write adds would take more
+// bitmap and extent blocks than fit in one transaction: the
+// caller may write the rest in another. Otherwise, if the
+// return value is less than the requested n, there was an
+// error of some kind.
+// The caller's transaction must have room for the inode and
+// each block the write overwrites; the rest goes to
+// allocating new blocks.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, nb, first, last, have;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -494,8 +1182,18 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  // allocate any blocks the write adds to the file first,
+  // so that they can be allocated as one run.
+  first = off / BSIZE;
+  last = (off + n + BSIZE - 1) / BSIZE;
+  have = xblocks(ip->ext, NEXTENT);
+  have = have > first ? min(have, last) - first : 0;
+  nb = iextend(ip, last, MAXOPBLOCKS - 1 - have);
+  if(off + n > nb*BSIZE)
+    n = off < nb*BSIZE ? nb*BSIZE - off : 0;
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 0));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -509,8 +1207,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // because iextend() might have added an extent to ip->ext[].
   iupdate(ip);
 
   return tot;
@@ -582,6 +1279,144 @@ dirlink(struct inode *dp, char *name, uint inum)
   return 0;
 }
 
+static struct ncentry**
+nchash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &ncache.hash[h % NNCHASH];
+}
+
+static int
+ncmatch(struct ncentry *e, uint dev, uint dinum, char *name)
+{
+  return e->dev == dev && e->dinum == dinum && namecmp(e->name, name) == 0;
+}
+
+// Return an entry to the free list, once rcu
+// says no lookup can still be reading it.
+static void
+ncfree(struct rcuhead *h)
+{
+  struct ncentry *e = (struct ncentry*)h;
+
+  acquire(&ncache.lock);
+  e->next = ncache.free;
+  ncache.free = e;
+  release(&ncache.lock);
+}
+
+// Look up name in directory dinum. Returns its inum,
+// or 0 if it isn't cached. Caller is in rcu_read_lock().
+static uint
+nclookup(uint dev, uint dinum, char *name)
+{
+  struct ncentry *e;
+
+  for(e = __atomic_load_n(nchash(dev, dinum, name), __ATOMIC_ACQUIRE); e;
+      e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)){
+    if(ncmatch(e, dev, dinum, name))
+      return e->inum;
+  }
+  return 0;
+}
+
+// Remember that name in dp refers to inum.
+// Caller holds dp's lock, shared or exclusive.
+static void
+ncinsert(struct inode *dp, char *name, uint inum)
+{
+  struct ncentry **hp, **pp, *e, *old = 0;
+  char *pa;
+  int i;
+
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return;
+
+  acquire(&ncache.lock);
+  hp = nchash(dp->dev, dp->inum, name);
+  for(e = *hp; e; e = e->next){
+    if(ncmatch(e, dp->dev, dp->inum, name)){
+      release(&ncache.lock);
+      return;
+    }
+  }
+  if(ncache.n >= NNCACHE){
+    // evict the oldest entry in this bucket.
+    if(*hp == 0){
+      release(&ncache.lock);
+      return;
+    }
+    for(pp = hp; (*pp)->next; pp = &(*pp)->next)
+      ;
+    old = *pp;
+    __atomic_store_n(pp, 0, __ATOMIC_RELEASE);
+    ncache.n--;
+  }
+  if(ncache.free == 0 && (pa = kalloc()) != 0){
+    for(i = 0; i < PGSIZE / sizeof(struct ncentry); i++){
+      e = (struct ncentry*)pa + i;
+      e->next = ncache.free;
+      ncache.free = e;
+    }
+  }
+  if((e = ncache.free) != 0){
+    ncache.free = e->next;
+    e->dev = dp->dev;
+    e->dinum = dp->inum;
+    e->inum = inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->next = *hp;
+    // lookups may see e as soon as it is in the chain.
+    __atomic_store_n(hp, e, __ATOMIC_RELEASE);
+    ncache.n++;
+  }
+  release(&ncache.lock);
+
+  if(old)
+    rcu_retire(&old->rcu, ncfree);
+}
+
+// Forget name in dp, which is being unlinked, or all of dp's
+// names if name is 0, since dp is being freed.
+// Caller holds dp's lock exclusively.
+void
+ncremove(struct inode *dp, char *name)
+{
+  struct ncentry **hp, **pp, *e, *dead = 0;
+
+  acquire(&ncache.lock);
+  for(hp = &ncache.hash[0]; hp < &ncache.hash[NNCHASH]; hp++){
+    if(name)
+      hp = nchash(dp->dev, dp->inum, name);
+    for(pp = hp; (e = *pp) != 0; ){
+      if(e->dev == dp->dev && e->dinum == dp->inum &&
+         (name == 0 || namecmp(e->name, name) == 0)){
+        __atomic_store_n(pp, e->next, __ATOMIC_RELEASE);
+        ncache.n--;
+        // lookups may still be following e->next, so
+        // chain dead entries through their rcuhead.
+        e->rcu.next = (struct rcuhead*)dead;
+        dead = e;
+      } else {
+        pp = &e->next;
+      }
+    }
+    if(name)
+      break;
+  }
+  // namefast() callers that might have seen a name must retry.
+  __atomic_store_n(&ncache.seq, ncache.seq + 1, __ATOMIC_RELEASE);
+  release(&ncache.lock);
+
+  while((e = dead) != 0){
+    dead = (struct ncentry*)e->rcu.next;
+    rcu_retire(&e->rcu, ncfree);
+  }
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -636,21 +1471,26 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    // lookups only read directories, so
+    // can proceed in parallel.
+    ilock_shared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlock_shared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlock_shared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    if(next)
+      ncinsert(ip, name, next->inum);
+    iunlock_shared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -660,10 +1500,60 @@ namex(char *path, int nameiparent, char *name)
   return ip;
 }
 
+// Look up path using only the name cache, without locking the
+// directories along it or itable. Returns 0 if some component
+// isn't cached or is ".", or if an unlink() may have raced with
+// the lookup.
+// Must be called inside a transaction since it calls iput().
+static struct inode*
+namefast(char *path)
+{
+  char name[DIRSIZ];
+  uint dev, inum, seq;
+  struct inode *ip;
+
+  if(*path == '/'){
+    dev = ROOTDEV;
+    inum = ROOTINO;
+  } else {
+    // cwd's dev and inum can't change while we hold a reference.
+    dev = myproc()->cwd->dev;
+    inum = myproc()->cwd->inum;
+  }
+
+  seq = __atomic_load_n(&ncache.seq, __ATOMIC_ACQUIRE);
+  rcu_read_lock();
+  while(inum != 0 && (path = skipelem(path, name)) != 0){
+    // "." would need to know that inum is a directory, which
+    // the cache doesn't record; leave it to namex().
+    if(namecmp(name, ".") == 0)
+      inum = 0;
+    else
+      inum = nclookup(dev, inum, name);
+  }
+  rcu_read_unlock();
+  if(inum == 0)
+    return 0;
+
+  ip = iget(dev, inum);
+  // if a name we used was unlinked meanwhile, its inode may
+  // have been freed, or even reused for another file.
+  __sync_synchronize();
+  if(__atomic_load_n(&ncache.seq, __ATOMIC_ACQUIRE) != seq){
+    iput(ip);
+    return 0;
+  }
+  return ip;
+}
+
 struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
+  struct inode *ip;
+
+  if((ip = namefast(path)) != 0)
+    return ip;
   return namex(path, 0, name);
 }
 
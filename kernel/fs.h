@@ -20,13 +20,30 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint orphan;       // First inode on the orphan list, or 0
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A file's content is a sequence of extents, runs of len
+// consecutive disk blocks starting at block addr, taken in
+// order; files have no holes. The inode holds NEXTENT of
+// them. A file that needs more has an extent tree: at depth
+// d > 0 each of the inode's entries is instead an index,
+// whose addr is a block holding NXPB entries of depth d-1
+// and whose len is the number of file blocks below it.
+struct extent {
+  uint addr;
+  uint len;
+};
+
+#define NEXTENT 6
+#define NXPB (BSIZE / sizeof(struct extent))
+#define MAXDEPTH 3
+// Largest file, in blocks, for 32-bit byte offsets. A tree
+// MAXDEPTH deep holds NEXTENT*NXPB^3 extents, enough for a
+// file of this size however fragmented.
+#define MAXFILE (0xffffffffU / BSIZE)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +52,9 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  ushort depth;         // Depth of the extent tree
+  ushort next;          // Next inode on the orphan list, or 0
+  struct extent ext[NEXTENT];   // Data block extents
 };
 
 // Inodes per block.
@@ -0,0 +1,65 @@
+//
+// Futexes: let user-space locks and condition variables
+// sleep in the kernel only when they have to wait.
+// A futex is a 32-bit user word, named by its physical
+// address so that threads sharing memory find each other.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "futex.h"
+#include "defs.h"
+
+#define NFUTEXQ 32
+
+// Serializes the check of *addr in FUTEX_WAIT with FUTEX_WAKE,
+// so a waker that changes *addr and then wakes can't be missed.
+struct spinlock futexlock[NFUTEXQ];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXQ; i++)
+    initlock(&futexlock[i], "futex");
+}
+
+// FUTEX_WAIT: if the int at user address addr holds val, sleep
+// until a FUTEX_WAKE on addr. Returns 0 after sleeping, or -1
+// if *addr != val. Callers must expect spurious wakeups.
+// FUTEX_WAKE: wake up to val procs waiting on addr, or all of
+// them if val < 0; returns how many.
+int
+futex(uint64 addr, int op, int val)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk;
+  uint64 pa;
+  int v, n;
+
+  if(addr % sizeof(int) != 0 || (pa = walkaddr(p->pagetable, addr)) == 0)
+    return -1;
+  pa += addr % PGSIZE;
+  lk = &futexlock[(pa / sizeof(int)) % NFUTEXQ];
+
+  switch(op){
+  case FUTEX_WAIT:
+    acquire(lk);
+    if(copyin(p->pagetable, (char*)&v, addr, sizeof(v)) < 0 || v != val || p->killed){
+      release(lk);
+      return -1;
+    }
+    sleep((void*)pa, lk);
+    release(lk);
+    return 0;
+  case FUTEX_WAKE:
+    acquire(lk);
+    n = wakeupn((void*)pa, val);
+    release(lk);
+    return n;
+  }
+  return -1;
+}
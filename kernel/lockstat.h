@@ -0,0 +1,14 @@
+// Contention statistics for one spinlock, from lockstat().
+struct lockstat {
+  char name[16];     // Name of lock.
+  uint64 nacquire;   // Times acquired.
+  uint64 nspin;      // Spin-loop iterations waiting to acquire.
+};
+
+#define NLOCKSTAT 32 // most locks lockstat() reports at once
+
+// How waits for held sleeplocks went, from sleepstat().
+struct sleepstat {
+  uint64 nspin;      // Waits that spun until the holder released.
+  uint64 nsleep;     // Waits that slept.
+};
@@ -28,19 +28,28 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous: commit() waits for each stage's
+// writes before the next. Within a stage, it writes LOGIO
+// blocks at a time, which the disk gets as one request when
+// they are consecutive, as log blocks are.
+
+#define LOGIO 16  // most block writes commit() has in flight
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
+// The header has room for LOGMAX block #s, so no more of a
+// larger log than that is used.
+#define LOGMAX (BSIZE / sizeof(int) - 1)
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int max;         // most blocks a commit can hold
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
   int dev;
@@ -51,15 +60,31 @@ struct log log;
 static void recover_from_log(void);
 static void commit();
 
+// Write the n locked bufs in io[], and release them.
+static void
+logio(struct buf **io, int n, int unpin)
+{
+  bwritev_async(io, n);
+  for(int i = 0; i < n; i++){
+    bwait(io[i]);
+    if(unpin)
+      bunpin(io[i]);
+    brelse(io[i]);
+  }
+}
+
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.max = log.size - 1 < LOGMAX ? log.size - 1 : LOGMAX;
+  if (log.max < MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
   recover_from_log();
 }
@@ -68,18 +93,21 @@ initlog(int dev, struct superblock *sb)
 static void
 install_trans(int recovering)
 {
-  int tail;
+  struct buf *io[LOGIO];
+  int tail, n = 0;
 
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
     brelse(lbuf);
-    brelse(dbuf);
+    io[n++] = dbuf;
+    if(n == LOGIO){
+      logio(io, n, recovering == 0);  // write dst to disk
+      n = 0;
+    }
   }
+  logio(io, n, recovering == 0);
 }
 
 // Read the log header from disk into the in-memory log header
@@ -130,7 +158,7 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.max){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -178,16 +206,21 @@ end_op(void)
 static void
 write_log(void)
 {
-  int tail;
+  struct buf *io[LOGIO];
+  int tail, n = 0;
 
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    io[n++] = to;
+    if(n == LOGIO){
+      logio(io, n, 0);  // write the log
+      n = 0;
+    }
   }
+  logio(io, n, 0);
 }
 
 static void
@@ -217,7 +250,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.max)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -25,9 +25,12 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    rcuinit();       // deferred freeing for lock-free readers
     iinit();         // inode table
     fileinit();      // file table
+    futexinit();     // futex wait queues
     virtio_disk_init(); // emulated hard disk
+    ramdiskinit();   // file system image in memory
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
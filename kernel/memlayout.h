@@ -27,8 +27,11 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // machine software interrupt.
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_FREQ 10000000L // mtime cycles per second in qemu.
+#define TICK_INTERVAL (CLINT_FREQ / TICKHZ) // cycles between timer interrupts.
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -62,6 +65,9 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   trapframes of threads made by clone(), one page each
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define TSLOT(i) (TRAPFRAME - (i)*PGSIZE) // trapframe of thread slot i
+#define MAXUVA TSLOT(NTHREAD-1) // user memory must end below the lowest slot
@@ -1,13 +1,31 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      2048  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NTHREAD      16  // maximum threads sharing an address space
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
-#define ROOTDEV       1  // device number of file system root disk
+#define VIRTIODEV     1  // device number of the virtio disk
+#define RAMDISKDEV    2  // device number of the RAM disk (RAMDISK)
+#ifdef RAMDISK
+#define ROOTDEV       RAMDISKDEV  // device number of file system root disk
+#else
+#define ROOTDEV       VIRTIODEV   // device number of file system root disk
+#endif
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*3)  // data blocks in on-disk log (mkfs default)
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#ifndef BCACHEFRAC
+#define BCACHEFRAC   4  // block cache grows to 1/BCACHEFRAC of free memory
+#endif
+#ifndef READAHEAD
+#define READAHEAD    32  // most blocks read ahead of a sequential reader; 0 for none
+#endif
+#define FSSIZE       98304 // size of file system in blocks (mkfs default)
 #define MAXPATH      128   // maximum file path name
+#ifndef TICKHZ
+#define TICKHZ       10    // timer interrupts per second
+#endif
+#define TICKSLICE    10    // ticks a lone process may run between interrupts (TICKLESS)
+#define TICKIDLE     100   // longest an idle hart defers its timer (TICKLESS)
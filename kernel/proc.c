@@ -8,13 +8,81 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// struct procs are carved out of kalloc()ed pages on demand, up to
+// NPROC of them in use at once. a page goes back to kalloc() once
+// all of its procs are free and kill() holds no pointer into it
+// (see findpid()). the page at ptable.page[i] gives its procs the
+// kernel stack addresses KSTACK(i*PROCPERPAGE) and up.
+struct procpage {
+  struct procpage *next;  // next page with free procs
+  struct proc *free;      // this page's unused procs, through p->next
+  int nused;              // procs handed out by procget()
+  int pin;                // findpid() callers; updated atomically
+  int index;              // in ptable.page[]
+  struct proc proc[];
+};
+#define PROCPERPAGE ((PGSIZE - sizeof(struct procpage)) / sizeof(struct proc))
+#define NPROCPAGE ((NPROC + PROCPERPAGE - 1) / PROCPERPAGE)
+#define PROCPAGE(p) ((struct procpage*)PGROUNDDOWN((uint64)(p)))
+
+struct {
+  struct spinlock lock;
+  struct procpage *page[NPROCPAGE];  // or 0 if not allocated
+  struct procpage *partial;          // pages with free procs
+  int nused;                         // procs in use
+} ptable;
+
+// struct vms come from kalloc()ed pages in the same way,
+// without the limit or kernel stacks.
+struct vmpage {
+  struct vmpage *next;    // next page with free vms
+  struct vm *free;        // this page's unused vms, through vm->next
+  int nused;
+  struct vm vm[];
+};
+#define VMPERPAGE ((PGSIZE - sizeof(struct vmpage)) / sizeof(struct vm))
+#define VMPAGE(vm) ((struct vmpage*)PGROUNDDOWN((uint64)(vm)))
+
+struct {
+  struct spinlock lock;
+  struct vmpage *partial; // pages with free vms
+} vmtable;
+
+// RUNNABLE processes, in FIFO order, linked through p->next.
+// p->lock is held when adding a process, so the lock order
+// is p->lock, then runq.lock.
+struct {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+} runq;
+
+// SLEEPING processes, hashed by p->chan and linked through
+// p->next, so wakeup() only looks at processes that might be
+// sleeping on its chan. a process is on a sleep queue exactly
+// when it is SLEEPING; whoever makes it RUNNABLE removes it.
+// the queue lock is acquired before any p->lock.
+#define NSLEEPQ 64
+#define SLEEPQ(chan) (&sleepq[((uint64)(chan) / 8) % NSLEEPQ])
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// pid -> proc hash table, so kill() need not scan proc[].
+// chains are linked through p->pidnext and protected by pid_lock.
+#define NPIDHASH 64
+static struct proc *pidhash[NPIDHASH];
+
+// number of processes on runq. protected by runq.lock;
+// read without locks as a hint by timerslice().
+int nrunnable;
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
 
@@ -26,19 +94,18 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// Allocate the page-table pages for the kernel stack area, high
+// in memory. Each stack is followed by an invalid guard page. The
+// stacks themselves are mapped by allocproc() and unmapped by
+// freeproc(); since the page-table pages already exist, that
+// never needs to allocate or lock the kernel page table.
 void
 proc_mapstacks(pagetable_t kpgtbl) {
-  struct proc *p;
+  uint64 va;
   
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  for(va = KSTACK(NPROCPAGE*PROCPERPAGE-1); va <= KSTACK(0); va += PGSIZE) {
+    if(walk(kpgtbl, va, 1) == 0)
+      panic("proc_mapstacks");
   }
 }
 
@@ -46,15 +113,317 @@ proc_mapstacks(pagetable_t kpgtbl) {
 void
 procinit(void)
 {
-  struct proc *p;
+  struct sleepq *sq;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
+  initlock(&ptable.lock, "ptable");
+  initlock(&vmtable.lock, "vmtable");
+  initlock(&runq.lock, "runq");
+  for(sq = sleepq; sq < &sleepq[NSLEEPQ]; sq++)
+    initlock(&sq->lock, "sleepq");
+}
+
+// Take an unused proc off a page's free list, carving up a fresh
+// page of them if none has one. Returns 0 if NPROC procs are
+// already in use, or if out of memory.
+static struct proc*
+procget(void)
+{
+  struct procpage *pg;
+  struct proc *p;
+  int i, n;
+
+  acquire(&ptable.lock);
+  if(ptable.nused >= NPROC){
+    release(&ptable.lock);
+    return 0;
+  }
+  if(ptable.partial == 0){
+    for(n = 0; n < NPROCPAGE && ptable.page[n]; n++)
+      ;
+    if(n == NPROCPAGE || (pg = kalloc()) == 0){
+      release(&ptable.lock);
+      return 0;
+    }
+    pg->free = 0;
+    pg->nused = 0;
+    pg->pin = 0;
+    pg->index = n;
+    for(i = PROCPERPAGE - 1; i >= 0; i--){
+      p = &pg->proc[i];
+      memset(p, 0, sizeof(*p));
       initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
+      p->kstack = KSTACK(n*PROCPERPAGE + i);
+      p->next = pg->free;
+      pg->free = p;
+    }
+    ptable.page[n] = pg;
+    pg->next = 0;
+    ptable.partial = pg;
+  }
+  pg = ptable.partial;
+  p = pg->free;
+  pg->free = p->next;
+  if(pg->free == 0)
+    ptable.partial = pg->next;
+  pg->nused++;
+  ptable.nused++;
+  release(&ptable.lock);
+  return p;
+}
+
+// If no proc in pg is in use or pinned, take pg out of
+// ptable and return it, to be kfree()d. Otherwise return 0.
+// Caller holds ptable.lock.
+static struct procpage*
+procshrink(struct procpage *pg)
+{
+  struct procpage **pp;
+
+  if(pg->nused > 0 || __atomic_load_n(&pg->pin, __ATOMIC_RELAXED) > 0)
+    return 0;
+  for(pp = &ptable.partial; *pp != pg; pp = &(*pp)->next)
+    ;
+  *pp = pg->next;
+  ptable.page[pg->index] = 0;
+  return pg;
+}
+
+// Return an unused proc to its page, and the page to
+// kalloc() if that was the last proc in use.
+// The caller must not hold p->lock, which is in the page.
+static void
+procput(struct proc *p)
+{
+  struct procpage *pg = PROCPAGE(p);
+
+  acquire(&ptable.lock);
+  if(pg->free == 0){
+    pg->next = ptable.partial;
+    ptable.partial = pg;
+  }
+  p->next = pg->free;
+  pg->free = p;
+  pg->nused--;
+  ptable.nused--;
+  pg = procshrink(pg);
+  release(&ptable.lock);
+  if(pg)
+    kfree(pg);
+}
+
+// Drop findpid()'s pin on p's page.
+static void
+procunpin(struct proc *p)
+{
+  struct procpage *pg = PROCPAGE(p);
+
+  acquire(&ptable.lock);
+  __sync_fetch_and_sub(&pg->pin, 1);
+  pg = procshrink(pg);
+  release(&ptable.lock);
+  if(pg)
+    kfree(pg);
+}
+
+// Allocate an address space with a reference count of one,
+// and trapframe slot 0 (TRAPFRAME) in use.
+// Returns 0 if out of memory.
+struct vm*
+allocvm(void)
+{
+  struct vmpage *pg;
+  struct vm *vm = 0;
+  int i;
+
+  acquire(&vmtable.lock);
+  if(vmtable.partial == 0 && (pg = kalloc()) != 0){
+    pg->free = 0;
+    pg->nused = 0;
+    for(i = VMPERPAGE - 1; i >= 0; i--){
+      vm = &pg->vm[i];
+      initlock(&vm->lock, "vm");
+      vm->next = pg->free;
+      pg->free = vm;
+    }
+    pg->next = 0;
+    vmtable.partial = pg;
+  }
+  if((pg = vmtable.partial) != 0){
+    vm = pg->free;
+    pg->free = vm->next;
+    if(pg->free == 0)
+      vmtable.partial = pg->next;
+    pg->nused++;
+  }
+  release(&vmtable.lock);
+
+  if(vm){
+    vm->busy = 0;
+    vm->ref = 1;
+    vm->tslots = 1;
+    vm->sz = 0;
+  }
+  return vm;
+}
+
+// Return an unused vm to its page, and the page to
+// kalloc() if no other vm in it is in use.
+void
+freevm(struct vm *vm)
+{
+  struct vmpage *pg = VMPAGE(vm), **pp;
+
+  acquire(&vmtable.lock);
+  if(pg->free == 0){
+    pg->next = vmtable.partial;
+    vmtable.partial = pg;
+  }
+  vm->next = pg->free;
+  pg->free = vm;
+  if(--pg->nused == 0){
+    for(pp = &vmtable.partial; *pp != pg; pp = &(*pp)->next)
+      ;
+    *pp = pg->next;
+  } else {
+    pg = 0;
+  }
+  release(&vmtable.lock);
+  if(pg)
+    kfree(pg);
+}
+
+// Drop p's reference to its address space: unmap p's
+// trapframe, and free the page table and user memory
+// if no other thread is using them.
+void
+dropvm(struct proc *p)
+{
+  struct vm *vm = p->vm;
+
+  uvmunmap(p->pagetable, p->trapva, 1, 0);
+  __sync_fetch_and_and(&vm->tslots, ~(1U << ((TRAPFRAME - p->trapva) / PGSIZE)));
+  if(__sync_sub_and_fetch(&vm->ref, 1) == 0){
+    uvmunmap(p->pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(p->pagetable, vm->sz);
+    freevm(vm);
+  }
+  p->vm = 0;
+  p->pagetable = 0;
+}
+
+// Join np to share's address space, mapping np's trapframe
+// in a free thread slot of the shared page table.
+// Returns 0 on success, -1 if all NTHREAD slots are in use.
+static int
+sharevm(struct proc *np, struct proc *share)
+{
+  struct vm *vm = share->vm;
+  uint old;
+  int i;
+
+  for(i = 1; i < NTHREAD; i++){
+    old = vm->tslots;
+    if((old & (1U << i)) == 0 &&
+       __sync_bool_compare_and_swap(&vm->tslots, old, old | (1U << i)))
+      break;
+  }
+  if(i == NTHREAD)
+    return -1;
+
+  // the page-table pages near TRAPFRAME already exist,
+  // so this doesn't allocate, and can't race with growproc().
+  if(mappages(share->pagetable, TSLOT(i), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    __sync_fetch_and_and(&vm->tslots, ~(1U << i));
+    return -1;
+  }
+  __sync_fetch_and_add(&vm->ref, 1);
+  np->vm = vm;
+  np->pagetable = share->pagetable;
+  np->trapva = TSLOT(i);
+  return 0;
+}
+
+// Get exclusive use of vm's page table and size, against
+// other threads' growproc() and fork(). May sleep, so the
+// holder can wait for other harts in tlbshootdown().
+static void
+lockvm(struct vm *vm)
+{
+  acquire(&vm->lock);
+  while(vm->busy)
+    sleep(vm, &vm->lock);
+  vm->busy = 1;
+  release(&vm->lock);
+}
+
+static void
+unlockvm(struct vm *vm)
+{
+  acquire(&vm->lock);
+  vm->busy = 0;
+  wakeup(vm);
+  release(&vm->lock);
+}
+
+#ifdef TICKLESS
+// Wake one hart that may be waiting in the scheduler's wfi,
+// with an IPI that devintr() takes as a timer interrupt.
+// the caller has queued a process and holds its p->lock.
+static void
+kickidle(void)
+{
+  struct cpu *c;
+
+  __sync_synchronize();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->idle && c != mycpu()){
+      *(uint32*)CLINT_MSIP(c - cpus) = 1;
+      return;
+    }
   }
 }
+#endif
+
+// Mark p RUNNABLE and append it to the run queue.
+// Caller must hold p->lock.
+static void
+makerunnable(struct proc *p)
+{
+  p->state = RUNNABLE;
+  acquire(&runq.lock);
+  p->next = 0;
+  if(runq.tail)
+    runq.tail->next = p;
+  else
+    runq.head = p;
+  runq.tail = p;
+  nrunnable++;
+  release(&runq.lock);
+#ifdef TICKLESS
+  kickidle();
+#endif
+}
+
+// Remove and return the process at the head of the
+// run queue, or 0 if there is none.
+static struct proc*
+runqget(void)
+{
+  struct proc *p;
+
+  acquire(&runq.lock);
+  if((p = runq.head) != 0){
+    runq.head = p->next;
+    if(runq.head == 0)
+      runq.tail = 0;
+    nrunnable--;
+  }
+  release(&runq.lock);
+  return p;
+}
 
 // Must be called with interrupts disabled,
 // to prevent race with process being moved
@@ -85,56 +454,114 @@ myproc(void) {
   return p;
 }
 
+// Allocate a pid for p and enter p in the pid hash table.
 int
-allocpid() {
+allocpid(struct proc *p) {
   int pid;
   
   acquire(&pid_lock);
   pid = nextpid;
   nextpid = nextpid + 1;
+  p->pid = pid;
+  p->pidnext = pidhash[pid % NPIDHASH];
+  pidhash[pid % NPIDHASH] = p;
   release(&pid_lock);
 
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Remove p from the pid hash table.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pidnext = 0;
+  release(&pid_lock);
+}
+
+// Return the proc with the given pid, or 0.
+// The result is only a hint: the caller must lock it
+// and check p->pid, since the proc may exit meanwhile.
+// p's page is pinned so that p stays a struct proc until
+// the caller is done with it and calls procunpin(p).
+static struct proc*
+findpid(int pid)
+{
+  struct proc *p;
+
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  // p is in use until freepid() takes pid_lock, so
+  // procput() can't free the page under the pin.
+  if(p)
+    __sync_fetch_and_add(&PROCPAGE(p)->pin, 1);
+  release(&pid_lock);
+  return p;
+}
+
+// Allocate an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. The proc gets a new, empty
+// address space, or shares share's if share is non-zero.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *share)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  if((p = procget()) == 0)
+    return 0;
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
 
-found:
-  p->pid = allocpid();
+  allocpid(p);
   p->state = USED;
 
-  // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  // Map a kernel stack.
+  if(kvmmapstack(p->kstack) < 0){
     freeproc(p);
-    release(&p->lock);
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  // Allocate a trapframe page.
+  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
-    release(&p->lock);
     return 0;
   }
 
+  if(share){
+    // Share the caller's user page table.
+    if(sharevm(p, share) < 0){
+      freeproc(p);
+      return 0;
+    }
+  } else {
+    // An empty user page table.
+    if((p->vm = allocvm()) == 0){
+      freeproc(p);
+      return 0;
+    }
+    p->trapva = TRAPFRAME;
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freevm(p->vm);
+      p->vm = 0;
+      freeproc(p);
+      return 0;
+    }
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -145,25 +572,35 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// including user pages and the kernel stack, and put
+// it back on the free list.
+// p->lock must be held; freeproc() releases it, since
+// p's page may go back to kalloc() with p.
 static void
 freeproc(struct proc *p)
 {
+  kvmunmapstack(p->kstack);
+  if(p->vm)
+    dropvm(p);
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  p->trapva = 0;
+  p->ustack = 0;
+  p->thread = 0;
+  if(p->pid)
+    freepid(p);
   p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+  release(&p->lock);
+  procput(p);
 }
 
 // Create a user page table for a given process,
@@ -227,13 +664,13 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->vm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -242,29 +679,131 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  makerunnable(p);
 
   release(&p->lock);
 }
 
+// Make sure no other hart still caches PTEs that were just
+// removed from vm's page table. Harts that may be running one
+// of vm's threads in user space get an IPI; the trap into the
+// kernel switches page tables, which flushes the TLB. Waits
+// for the other harts, so the caller must not hold spinlocks.
+void
+tlbshootdown(struct vm *vm)
+{
+  struct cpu *c, *me;
+  struct proc *p;
+
+  __sync_synchronize();
+  push_off();
+  me = mycpu();
+  pop_off();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    // c->proc may exit and its page go back to kalloc()
+    // meanwhile; p->vm then reads as junk, which at worst
+    // costs that hart an unneeded TLB flush.
+    if(c == me || (p = c->proc) == 0 || p->vm != vm)
+      continue;
+    c->ipi = 1;
+    __sync_synchronize();
+    *(uint32*)CLINT_MSIP(c - cpus) = 1;
+    while(c->ipi)
+      __sync_synchronize();
+  }
+  sfence_vma();
+}
+
+// Shrink p's shared address space from oldsz to newsz: unmap the
+// pages, shoot down other harts' TLB entries for them, and only
+// then free them, in batches. The shootdown also waits out other
+// threads' copyin()s and copyout()s, which keep interrupts off
+// while they use a page.
+// Caller must have p->vm locked with lockvm().
+static void
+shrinkvm(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  uint64 pa[32], a, end;
+  pte_t *pte;
+  int i, n;
+
+  a = PGROUNDUP(newsz);
+  end = PGROUNDUP(oldsz);
+  while(a < end){
+    for(n = 0; n < NELEM(pa) && a < end; n++, a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        panic("shrinkvm");
+      pa[n] = PTE2PA(*pte);
+      *pte = 0;
+    }
+    tlbshootdown(p->vm);
+    for(i = 0; i < n; i++)
+      kfree((void*)pa[i]);
+  }
+}
+
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Return the old size on success, -1 on failure.
+uint64
 growproc(int n)
 {
-  uint sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct vm *vm = p->vm;
 
-  sz = p->sz;
+  lockvm(vm);
+  sz = oldsz = vm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > MAXUVA || (sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+      unlockvm(vm);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+  } else if(n < 0 && sz + n < sz){
+    // other threads may be using this page table
+    // on other harts; they need to forget the pages.
+    if(vm->ref > 1)
+      shrinkvm(p, sz, sz + n);
+    else
+      uvmdealloc(p->pagetable, sz, sz + n);
+    sz = sz + n;
   }
-  p->sz = sz;
-  return 0;
+  vm->sz = sz;
+  unlockvm(vm);
+  return oldsz;
+}
+
+// Finish setting up a new child np of the current process,
+// holding np->lock: give it copies of the parent's open file
+// and cwd references, make it a child, and make it RUNNABLE.
+// Releases np->lock and returns np's pid.
+static int
+startchild(struct proc *np)
+{
+  int i, pid;
+  struct proc *p = myproc();
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
+
+  return pid;
 }
 
 // Create a new process, copying the parent.
@@ -272,22 +811,23 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
   struct proc *np;
   struct proc *p = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  lockvm(p->vm);
+  if(uvmcopy(p->pagetable, np->pagetable, p->vm->sz) < 0){
+    unlockvm(p->vm);
     freeproc(np);
-    release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->vm->sz = p->vm->sz;
+  unlockvm(p->vm);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -295,27 +835,38 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
-
-  safestrcpy(np->name, p->name, sizeof(p->name));
-
-  pid = np->pid;
+  return startchild(np);
+}
 
-  release(&np->lock);
+// Create a new thread sharing the caller's address space.
+// It starts in user space at fn(arg), on the stack whose top
+// is ustack, and gets its own trapframe and copies of the
+// caller's open file and cwd references, as in fork().
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 ustack)
+{
+  struct proc *np;
+  struct proc *p = myproc();
 
-  acquire(&wait_lock);
-  np->parent = p;
-  release(&wait_lock);
+  if(ustack % 16 != 0)
+    return -1;
 
-  acquire(&np->lock);
-  np->state = RUNNABLE;
-  release(&np->lock);
+  if((np = allocproc(p)) == 0){
+    return -1;
+  }
 
-  return pid;
+  // same registers as the caller (e.g. gp), but
+  // a different pc, stack, and argument.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = ustack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;   // fn must call exit(), not return
+  np->ustack = ustack;
+  np->thread = 1;
+
+  return startchild(np);
 }
 
 // Pass p's abandoned children to init.
@@ -325,12 +876,18 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+  for(pp = p->children; ; pp = pp->sibling){
+    pp->parent = initproc;
+    pp->thread = 0;  // so init's wait() reaps it
+    if(pp->sibling == 0)
+      break;
   }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -378,46 +935,50 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child of the current process to exit, and return
+// its pid. Only considers threads if thread is set, and only
+// processes otherwise. If addr is non-zero, copy the child's exit
+// status (or, for a thread, the top of its stack) to addr.
+// Return -1 if there are no such children.
+static int
+waitchild(int thread, uint64 addr)
 {
-  struct proc *np;
-  int havekids, pid;
+  struct proc *np, **npp;
+  int pid, found;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+    // Scan through our children looking for exited ones.
+    found = 0;
+    for(npp = &p->children; (np = *npp) != 0; npp = &np->sibling){
+      if(np->thread != thread)
+        continue;
+      found = 1;
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->pagetable, addr,
+                                thread ? (char *)&np->ustack : (char *)&np->xstate,
+                                thread ? sizeof(np->ustack) : sizeof(np->xstate)) < 0) {
           release(&np->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
-        release(&np->lock);
+        *npp = np->sibling;
+        freeproc(np);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(!found || p->killed){
       release(&wait_lock);
       return -1;
     }
@@ -427,6 +988,23 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return waitchild(0, addr);
+}
+
+// Wait for a thread created by clone() to exit and return its pid.
+// Copies the thread's stack top to stackp, so the caller can free it.
+// Return -1 if this process has no threads.
+int
+join(uint64 stackp)
+{
+  return waitchild(1, stackp);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -445,22 +1023,57 @@ scheduler(void)
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    // peek without the lock, so that idle harts
+    // don't all hammer runq.lock.
+    __sync_synchronize();
+    if(runq.head == 0 || (p = runqget()) == 0){
+#ifdef TICKLESS
+      // nothing to run: wait in wfi until a device interrupt,
+      // the next sleep deadline, or makerunnable()'s kick, with
+      // no periodic ticks in between. c->idle is set before the
+      // second look at the run queue, and interrupts are off so
+      // a kick that lands in between still ends the wfi.
+      if(!c->idle){
+        timerdefer(TICKIDLE);
+        c->idle = 1;
       }
-      release(&p->lock);
+      intr_off();
+      __sync_synchronize();
+      if(runq.head == 0)
+        wfi();
+#endif
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+
+    // a kernel stack may have been unmapped and its
+    // address reused since this hart last flushed its TLB.
+    if(c->kstackgen != kstackgen){
+      c->kstackgen = kstackgen;
+      sfence_vma();
     }
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+#ifdef TICKLESS
+    // this hart may have deferred its timer while idle,
+    // or while running a process that was alone; give
+    // the new process a tick so timerslice() can decide.
+    timerdefer(1);
+    c->idle = 0;
+#endif
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -497,7 +1110,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  makerunnable(p);
   sched();
   release(&p->lock);
 }
@@ -529,6 +1142,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = SLEEPQ(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -536,13 +1150,18 @@ sleep(void *chan, struct spinlock *lk)
   // guaranteed that we won't miss any wakeup
   // (wakeup locks p->lock),
   // so it's okay to release lk.
+  // The sleep queue's lock comes first, as in wakeup().
 
+  acquire(&sq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->next = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -559,17 +1178,34 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+// Wake up at most n processes sleeping on chan, or all
+// of them if n < 0. Returns the number woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *sq = SLEEPQ(chan);
+  struct proc *p, **pp;
+  int woken = 0;
+
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0 && woken != n; ){
+    // p->chan can't change while p is on the queue.
+    if(p->chan != chan){
+      pp = &p->next;
+      continue;
     }
+    acquire(&p->lock);
+    *pp = p->next;
+    makerunnable(p);
+    release(&p->lock);
+    woken++;
   }
+  release(&sq->lock);
+  return woken;
 }
 
 // Kill the process with the given pid.
@@ -578,22 +1214,40 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
+  struct sleepq *sq;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  if((p = findpid(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid){
+    // exited and freed since findpid().
+    release(&p->lock);
+    procunpin(p);
+    return -1;
+  }
+  p->killed = 1;
+
+  // Wake process from sleep(), if it's sleeping.
+  // The sleep queue lock must come before p->lock, so p
+  // may wake and sleep again on another chan while neither
+  // is held; check its queue again once both are.
+  while(p->pid == pid && p->state == SLEEPING){
+    sq = SLEEPQ(p->chan);
+    release(&p->lock);
+    acquire(&sq->lock);
     acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
+    if(p->pid == pid && p->state == SLEEPING && SLEEPQ(p->chan) == sq){
+      for(pp = &sq->head; *pp != p; pp = &(*pp)->next)
+        ;
+      *pp = p->next;
+      makerunnable(p);
     }
-    release(&p->lock);
+    release(&sq->lock);
   }
-  return -1;
+  release(&p->lock);
+  procunpin(p);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -639,18 +1293,25 @@ procdump(void)
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
+  struct procpage *pg;
   struct proc *p;
   char *state;
+  int i;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
+  for(i = 0; i < NPROCPAGE; i++){
+    if((pg = ptable.page[i]) == 0)
       continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
+    for(p = pg->proc; p < &pg->proc[PROCPERPAGE]; p++){
+      if(p->state == UNUSED)
+        continue;
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s", p->pid, state, p->name);
+      printf("\n");
+    }
   }
+  sleeplockdump();
 }
@@ -24,6 +24,15 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Timer deferred while idle (TICKLESS)?
+  uint kstackgen;             // kstackgen as of this CPU's last TLB flush.
+  int ipi;                    // TLB shootdown requested by another CPU?
+  int rcunest;                // Depth of rcu_read_lock() nesting.
+  uint64 rcuepoch;            // rcu epoch seen by the outermost rcu_read_lock().
+#ifdef SPINLOCK_MCS
+  struct mcsnode mcs[NMCS];   // Queue nodes for acquire().
+  uint mcsused;               // Which of mcs[] are in use.
+#endif
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +89,18 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A user address space. Threads made by clone() share their
+// creator's, so it is reference counted; the last proc to let
+// go of it frees the page table and user memory.
+struct vm {
+  struct spinlock lock;
+  int busy;                    // growproc() or fork() is using the page table
+  int ref;                     // procs sharing this vm; updated atomically
+  uint tslots;                 // trapframe slots in use; updated atomically
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vm *next;             // free list
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -92,15 +113,24 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  struct proc *next;           // On runq, a sleep queue, or the free list
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  int thread;                  // Made by clone(); reaped by join(), not wait()
+  struct proc *children;       // List of this process's children
+  struct proc *sibling;        // Next child of the same parent
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next proc in the same pidhash[] chain
 
   // these are private to the process, so p->lock need not be held.
-  uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  uint64 kstack;               // Virtual address of kernel stack (fixed)
+  struct vm *vm;               // User address space, maybe shared
+  pagetable_t pagetable;       // User page table, the same as vm's other procs'
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 trapva;               // User address of trapframe (TRAPFRAME or a thread slot)
+  uint64 ustack;               // clone()'s user stack, returned by join()
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
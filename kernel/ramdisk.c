@@ -1,5 +1,11 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// ramdisk that serves the file system image from memory.
+//
+// building with RAMDISK=1 links fs.img into the kernel, as
+// data, and makes the ramdisk the root device. I/O is a
+// memmove(), so file system benchmarks run without the
+// virtio disk's latency. writes change only the in-memory
+// copy; fs.img itself is never changed.
 //
 
 #include "types.h"
@@ -12,34 +18,41 @@
 #include "fs.h"
 #include "buf.h"
 
+#ifdef RAMDISK
+// from ld -b binary fs.img.
+extern char _binary_fs_img_start[], _binary_fs_img_end[];
+#define IMGSTART _binary_fs_img_start
+#define IMGEND _binary_fs_img_end
+#else
+#define IMGSTART ((char*)0)
+#define IMGEND ((char*)0)
+#endif
+
+static uint nblock;   // blocks in the image
+
 void
 ramdiskinit(void)
 {
+  nblock = (IMGEND - IMGSTART) / BSIZE;
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Read or write b, which is locked, and then call its
+// iodone, if it has one, as the disk interrupt would.
 void
-ramdiskrw(struct buf *b)
+ramdiskrw(struct buf *b, int write)
 {
-  if(!holdingsleep(&b->lock))
+  if(b->iodone == 0 && !holdingsleep(&b->lock))
     panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
+  if(b->blockno >= nblock)
     panic("ramdiskrw: blockno too big");
 
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
+  char *addr = IMGSTART + (uint64)b->blockno * BSIZE;
 
-  if(b->flags & B_DIRTY){
-    // write
+  if(write){
     memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
   } else {
-    // read
     memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
   }
+  if(b->iodone)
+    b->iodone(b);
 }
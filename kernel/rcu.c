@@ -0,0 +1,112 @@
+//
+// Epoch-based reclamation, for data structures that are
+// read without locks (see the name cache in fs.c).
+//
+// Readers bracket their accesses with rcu_read_lock() and
+// rcu_read_unlock(), which disable interrupts, so a reader
+// never sleeps or switches away inside. A writer unlinks an
+// object under its own lock and passes it to rcu_retire(),
+// which holds it in limbo until no reader can still be
+// using it: the global epoch only advances when every CPU
+// inside a read section has seen the current epoch, so once
+// it has advanced twice past the epoch an object was retired
+// in, no reader that could have found the object remains.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "rcu.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  uint64 epoch;
+  struct rcuhead *limbo[3];  // retired in epoch e, at limbo[e%3]
+} rcu;
+
+void
+rcuinit(void)
+{
+  initlock(&rcu.lock, "rcu");
+}
+
+void
+rcu_read_lock(void)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  if(c->rcunest++ == 0){
+    c->rcuepoch = __atomic_load_n(&rcu.epoch, __ATOMIC_RELAXED);
+    // announce the epoch before reading any shared pointers.
+    __sync_synchronize();
+  }
+}
+
+void
+rcu_read_unlock(void)
+{
+  struct cpu *c = mycpu();
+
+  if(c->rcunest < 1)
+    panic("rcu_read_unlock");
+  __sync_synchronize();
+  c->rcunest--;
+  pop_off();
+}
+
+// Advance the epoch if every CPU in a read section has
+// seen the current one. Returns the objects it is now
+// safe to free. Caller holds rcu.lock.
+static struct rcuhead*
+rcu_advance(void)
+{
+  struct cpu *c;
+  struct rcuhead *done;
+
+  __sync_synchronize();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(__atomic_load_n(&c->rcunest, __ATOMIC_RELAXED) > 0 &&
+       __atomic_load_n(&c->rcuepoch, __ATOMIC_RELAXED) != rcu.epoch)
+      return 0;
+  }
+  __atomic_store_n(&rcu.epoch, rcu.epoch + 1, __ATOMIC_RELAXED);
+  // limbo[(epoch+1)%3] holds what was retired in epoch-2.
+  done = rcu.limbo[rcu.epoch % 3];
+  rcu.limbo[rcu.epoch % 3] = 0;
+  return done;
+}
+
+static void
+rcu_free(struct rcuhead *h)
+{
+  struct rcuhead *next;
+
+  for(; h; h = next){
+    next = h->next;
+    h->free(h);
+  }
+}
+
+// Call h->free(h) once no reader can be using h's object,
+// which must already be unreachable. Objects whose grace
+// period has passed are freed here, so the caller must not
+// hold locks that free functions take.
+void
+rcu_retire(struct rcuhead *h, void (*free)(struct rcuhead*))
+{
+  struct rcuhead *done;
+
+  h->free = free;
+  acquire(&rcu.lock);
+  h->next = rcu.limbo[rcu.epoch % 3];
+  rcu.limbo[rcu.epoch % 3] = h;
+  done = rcu_advance();
+  release(&rcu.lock);
+  rcu_free(done);
+}
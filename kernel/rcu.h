@@ -0,0 +1,7 @@
+// Deferred freeing for data read without locks.
+// Embed a struct rcuhead in each object, and hand the
+// object to rcu_retire() once it is unreachable.
+struct rcuhead {
+  struct rcuhead *next;
+  void (*free)(struct rcuhead*);
+};
@@ -331,6 +331,14 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// stall the hart until an interrupt is pending. it returns
+// even if interrupts are off, leaving the interrupt pending.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
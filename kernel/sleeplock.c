@@ -8,6 +8,14 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "sleeplock.h"
+#include "lockstat.h"
+
+// How often acquiring a held sleeplock was done by spinning,
+// avoiding a sleep, and how often it slept. Counted per CPU.
+static struct {
+  uint64 nspin;
+  uint64 nsleep;
+} waits[NCPU];
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -15,18 +23,67 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->writers = 0;
   lk->pid = 0;
+  lk->owner = 0;
+}
+
+// Wait for lk to be released by its exclusive holder, if
+// that holder is running on another CPU and so will likely
+// release it soon: spinning is cheaper than sleep() and
+// wakeup(). Returns 0 without waiting if the holder isn't
+// running, so the caller should sleep instead.
+// Caller holds lk->lk, which is released while spinning.
+static int
+spinwait(struct sleeplock *lk)
+{
+  struct proc *owner = lk->owner;
+
+  // owner->state is read without owner->lock; it is only a
+  // hint. owner may have exited and its page gone back to
+  // kalloc, but kernel memory is always mapped, and once
+  // lk->owner changes the loop below stops looking.
+  if(owner == 0 || owner->state != RUNNING)
+    return 0;
+  release(&lk->lk);
+  while(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) == owner &&
+        __atomic_load_n(&owner->state, __ATOMIC_RELAXED) == RUNNING)
+    ;
+  acquire(&lk->lk);
+  return 1;
+}
+
+// Count how a wait for a held lock went; lk->lk is held.
+static void
+waitstat(int spun, int slept)
+{
+  if(slept)
+    waits[cpuid()].nsleep++;
+  else if(spun)
+    waits[cpuid()].nspin++;
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  int spun = 0, slept = 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->writers++;
+  while (lk->locked || lk->readers) {
+    if(spinwait(lk)){
+      spun = 1;
+      continue;
+    }
     sleep(lk, &lk->lk);
+    slept = 1;
   }
+  waitstat(spun, slept);
+  lk->writers--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
   release(&lk->lk);
 }
 
@@ -36,10 +93,69 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// Give up ownership of exclusively held lk without
+// releasing it, so that another context, such as an
+// interrupt handler, can call releasesleep() instead.
+// Waiters then sleep rather than spin on a holder that
+// is no longer working towards releasing it.
+void
+disownsleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->pid = 0;
+  lk->owner = 0;
+  release(&lk->lk);
+}
+
+// Acquire lk shared with other readers. Waiting writers
+// go first, so a stream of readers can't starve them.
+void
+acquiresleep_shared(struct sleeplock *lk)
+{
+  int spun = 0, slept = 0;
+
+  acquire(&lk->lk);
+  while (lk->locked || lk->writers) {
+    if(spinwait(lk)){
+      spun = 1;
+      continue;
+    }
+    sleep(lk, &lk->lk);
+    slept = 1;
+  }
+  waitstat(spun, slept);
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleep_shared");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Is lk held, exclusively by this process or shared by anyone?
+int
+holdingsleep_shared(struct sleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = lk->readers > 0 || (lk->locked && lk->pid == myproc()->pid);
+  release(&lk->lk);
+  return r;
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -51,5 +167,25 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+// Total how often waits for sleeplocks spun instead of
+// sleeping. No lock: the per-CPU counts are only ever
+// added to, so a racing wait is at worst missed.
+void
+sleepstat(struct sleepstat *st)
+{
+  st->nspin = st->nsleep = 0;
+  for(int i = 0; i < NCPU; i++){
+    st->nspin += waits[i].nspin;
+    st->nsleep += waits[i].nsleep;
+  }
+}
 
+// Print sleepstat()'s counts, for procdump().
+void
+sleeplockdump(void)
+{
+  struct sleepstat st;
 
+  sleepstat(&st);
+  printf("sleeplocks: %d waits spun, %d slept\n", (int)st.nspin, (int)st.nsleep);
+}
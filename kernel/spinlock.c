@@ -6,31 +6,137 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "lockstat.h"
 #include "defs.h"
 
+// The list of all locks, for lockstat(). initlock() adds to it,
+// so it is protected by a bare test-and-set word rather than
+// by a spinlock.
+static struct spinlock *locks;
+static uint lockslock;
+
+static void
+lockslist(void)
+{
+  push_off();
+  while(__sync_lock_test_and_set(&lockslock, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+static void
+locksunlist(void)
+{
+  __sync_synchronize();
+  __sync_lock_release(&lockslock);
+  pop_off();
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  memset(lk->count, 0, sizeof(lk->count));
+  lockslist();
+  lk->prevlock = 0;
+  lk->nextlock = locks;
+  if(locks)
+    locks->prevlock = lk;
+  locks = lk;
+  locksunlist();
+#if defined(SPINLOCK_TICKET)
+  lk->next = 0;
+  lk->owner = 0;
+#elif defined(SPINLOCK_MCS)
+  lk->tail = 0;
+  lk->node = 0;
+#endif
+}
+
+// Remove a lock from the list of all locks, before
+// freeing the memory that holds it.
+void
+freelock(struct spinlock *lk)
+{
+  lockslist();
+  if(lk->prevlock)
+    lk->prevlock->nextlock = lk->nextlock;
+  else
+    locks = lk->nextlock;
+  if(lk->nextlock)
+    lk->nextlock->prevlock = lk->prevlock;
+  locksunlist();
 }
 
+#ifdef SPINLOCK_MCS
+// Take one of this CPU's queue nodes.
+// Interrupts must be off.
+static struct mcsnode*
+mcsget(void)
+{
+  struct cpu *c = mycpu();
+  int i;
+
+  for(i = 0; i < NMCS; i++){
+    if((c->mcsused & (1 << i)) == 0){
+      c->mcsused |= 1 << i;
+      return &c->mcs[i];
+    }
+  }
+  panic("acquire: out of mcs nodes");
+}
+
+static void
+mcsput(struct mcsnode *n)
+{
+  struct cpu *c = mycpu();
+
+  c->mcsused &= ~(1 << (n - c->mcs));
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 void
 acquire(struct spinlock *lk)
 {
+  uint64 spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
+#if defined(SPINLOCK_TICKET)
+  // Take a ticket, then wait for it to be served.
+  // On RISC-V, the fetch-and-add is an amoadd.w.
+  uint t = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+  while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t)
+    spins++;
+  lk->locked = 1;
+#elif defined(SPINLOCK_MCS)
+  // Join the end of the queue, then spin on our own node
+  // until the CPU ahead of us hands the lock over.
+  struct mcsnode *n = mcsget(), *prev;
+  n->next = 0;
+  n->wait = 1;
+  prev = __atomic_exchange_n(&lk->tail, n, __ATOMIC_ACQ_REL);
+  if(prev){
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&n->wait, __ATOMIC_ACQUIRE))
+      spins++;
+  }
+  lk->node = n;
+  lk->locked = 1;
+#else
   // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    spins++;
+#endif
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +146,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->count[lk->cpu - cpus].nacquire++;
+  lk->count[lk->cpu - cpus].nspin += spins;
 }
 
 // Release the lock.
@@ -59,6 +167,30 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
+#if defined(SPINLOCK_TICKET)
+  // Serve the next ticket.
+  lk->locked = 0;
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+#elif defined(SPINLOCK_MCS)
+  // Hand the lock to the next CPU in the queue, if any.
+  struct mcsnode *n = lk->node, *next, *self = n;
+  lk->locked = 0;
+  lk->node = 0;
+  if((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == 0){
+    if(__atomic_compare_exchange_n(&lk->tail, &self, 0, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+      mcsput(n);
+      pop_off();
+      return;
+    }
+    // a new waiter has swapped itself into tail, but
+    // hasn't linked itself to n yet.
+    while((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == 0)
+      ;
+  }
+  __atomic_store_n(&next->wait, 0, __ATOMIC_RELEASE);
+  mcsput(n);
+#else
   // Release the lock, equivalent to lk->locked = 0.
   // This code doesn't use a C assignment, since the C standard
   // implies that an assignment might be implemented with
@@ -67,10 +199,56 @@ release(struct spinlock *lk)
   //   s1 = &lk->locked
   //   amoswap.w zero, zero, (s1)
   __sync_lock_release(&lk->locked);
+#endif
 
   pop_off();
 }
 
+// Copy statistics for the (at most n) locks with the most spins
+// to the user array at addr, most contended first, and return
+// how many were copied. If addr is 0, reset all locks' counts.
+int
+lockstat(uint64 addr, int n)
+{
+  struct lockstat top[NLOCKSTAT], ls;
+  struct spinlock *lk;
+  int i, j, k, ntop = 0;
+
+  if(n > NLOCKSTAT)
+    n = NLOCKSTAT;
+
+  lockslist();
+  for(lk = locks; lk; lk = lk->nextlock){
+    if(addr == 0){
+      memset(lk->count, 0, sizeof(lk->count));
+      continue;
+    }
+    ls.nacquire = ls.nspin = 0;
+    for(k = 0; k < NCPU; k++){
+      ls.nacquire += lk->count[k].nacquire;
+      ls.nspin += lk->count[k].nspin;
+    }
+    if(ls.nacquire == 0)
+      continue;
+    // insertion into top[], which is sorted by nspin.
+    for(i = ntop; i > 0 && top[i-1].nspin < ls.nspin; i--)
+      ;
+    if(i >= n)
+      continue;
+    if(ntop < n)
+      ntop++;
+    for(j = ntop - 1; j > i; j--)
+      top[j] = top[j-1];
+    safestrcpy(ls.name, lk->name, sizeof(ls.name));
+    top[i] = ls;
+  }
+  locksunlist();
+
+  if(ntop > 0 && copyout(myproc()->pagetable, addr, (char*)top, ntop * sizeof(top[0])) < 0)
+    return -1;
+  return ntop;
+}
+
 // Check whether this cpu is holding the lock.
 // Interrupts must be off.
 int
@@ -1,9 +1,40 @@
 // Mutual exclusion lock.
+//
+// By default a lock is a single word that waiting CPUs
+// test-and-set. Building with SPINLOCK=ticket or SPINLOCK=mcs
+// selects a queued lock instead, which hands the lock to
+// waiters in FIFO order: ticket locks have waiters spin on
+// one shared word, MCS locks on a per-CPU queue node.
+
+#ifdef SPINLOCK_MCS
+// An MCS queue node; each CPU has NMCS of them, one
+// for each lock it may be holding or waiting for.
+#define NMCS 16
+struct mcsnode {
+  struct mcsnode *next; // Next waiter in the queue.
+  int wait;             // Set until the previous holder hands over.
+};
+#endif
+
 struct spinlock {
+#if defined(SPINLOCK_TICKET)
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket now being served.
+#elif defined(SPINLOCK_MCS)
+  struct mcsnode *tail; // Last CPU in the queue, or 0 if free.
+  struct mcsnode *node; // The holder's queue node.
+#endif
   uint locked;       // Is the lock held?
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For lockstat(); each CPU counts in its own slot.
+  struct spinlock *nextlock; // List of all locks.
+  struct spinlock *prevlock;
+  struct {
+    uint64 nacquire;         // Times acquired.
+    uint64 nspin;            // Spin-loop iterations waiting to acquire.
+  } count[NCPU];
+};
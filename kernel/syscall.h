@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_clone  22
+#define SYS_join   23
+#define SYS_futex  24
+#define SYS_lockstat 25
+#define SYS_bstat  26
+#define SYS_sleepstat 27
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "bstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -218,6 +219,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  ncremove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -226,6 +228,8 @@ sys_unlink(void)
 
   ip->nlink--;
   iupdate(ip);
+  if(ip->nlink == 0)
+    iorphan(ip);
   iunlockput(ip);
 
   end_op();
@@ -336,6 +340,7 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    memset(&f->ra, 0, sizeof(f->ra));
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -484,3 +489,17 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_bstat(void)
+{
+  uint64 addr;
+  struct bstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
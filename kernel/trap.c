@@ -9,17 +9,26 @@
 struct spinlock tickslock;
 uint ticks;
 
+// ticks is derived from the CLINT's mtime rather than counted
+// interrupts, so that harts may skip timer interrupts (TICKLESS)
+// without losing time.
+static uint64 tickbase;     // mtime when ticks was zero.
+static int tickarmed;       // is some sys_sleep() waiting for tickdeadline?
+static uint tickdeadline;   // earliest tick a sleeper is waiting for.
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
+static int timerslice(void);
 
 void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  tickbase = *(uint64*)CLINT_MTIME;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -77,7 +86,7 @@ usertrap(void)
     exit(-1);
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  if(which_dev == 2 && timerslice())
     yield();
 
   usertrapret();
@@ -125,7 +134,7 @@ usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->trapva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -150,24 +159,105 @@ kerneltrap()
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING &&
+     timerslice())
     yield();
 
+#ifdef TICKLESS
+  // an idle hart's deferred interrupt has fired, and timervec
+  // has gone back to periodic ticks; have the scheduler defer
+  // again on its next idle pass.
+  if(which_dev == 2 && myproc() == 0)
+    mycpu()->idle = 0;
+#endif
+
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
   w_sstatus(sstatus);
 }
 
+// bring ticks up to date with the CLINT's mtime, and wake
+// up sys_sleep() callers if the earliest deadline has passed.
+// caller must hold tickslock.
+void
+tickupdate(void)
+{
+  uint t = (*(uint64*)CLINT_MTIME - tickbase) / TICK_INTERVAL;
+
+  if(t == ticks)
+    return;
+  ticks = t;
+  if(tickarmed && (int)(ticks - tickdeadline) >= 0){
+    tickarmed = 0;
+    wakeup(&ticks);
+  }
+}
+
+// ask for a wakeup(&ticks) once ticks reaches deadline.
+// sleepers re-arm each time they are woken, so only the
+// earliest deadline needs to be remembered.
+// caller must hold tickslock.
+void
+tickarm(uint deadline)
+{
+  if(!tickarmed || (int)(deadline - tickdeadline) < 0){
+    tickdeadline = deadline;
+    tickarmed = 1;
+  }
+}
+
 void
 clockintr()
 {
+  // any hart may advance ticks, since hart 0 may be
+  // deferring its interrupts; only lock when it's due.
+  if((*(uint64*)CLINT_MTIME - tickbase) / TICK_INTERVAL == ticks)
+    return;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  tickupdate();
   release(&tickslock);
 }
 
+// program this hart's next timer interrupt for the tick boundary
+// maxticks from now, or for the earliest sys_sleep() deadline if
+// that comes first. the machine-mode timervec resumes periodic
+// interrupts from there. reads the deadline without tickslock,
+// since callers may hold a p->lock; a stale value only costs an
+// early interrupt, or a late one that the next tick corrects.
+void
+timerdefer(int maxticks)
+{
+  uint64 now = *(uint64*)CLINT_MTIME;
+  uint t = (now - tickbase) / TICK_INTERVAL;
+  int n = maxticks;
+
+  if(tickarmed){
+    int d = tickdeadline - t;
+    if(d < 1)
+      d = 1;
+    if(d < n)
+      n = d;
+  }
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = tickbase + ((uint64)t + n) * TICK_INTERVAL;
+}
+
+// decide whether a timer interrupt should preempt the current
+// process. in tickless mode a process that no one else is waiting
+// to run keeps the CPU, and its next interrupt is put off until
+// the end of its time slice or the next sleep deadline.
+static int
+timerslice(void)
+{
+#ifdef TICKLESS
+  if(nrunnable == 0){
+    timerdefer(TICKSLICE);
+    return 0;
+  }
+#endif
+  return 1;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -201,17 +291,24 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    if(mycpu()->ipi){
+      // tlbshootdown() on another hart.
+      sfence_vma();
+      __sync_synchronize();
+      mycpu()->ipi = 0;
+      clockintr();  // in case a timer interrupt was merged in
+      return 1;
+    }
+
+    clockintr();
+
     return 2;
   } else {
     return 0;
@@ -27,6 +27,7 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -43,9 +44,10 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; the device may offer
+// fewer, in which case the driver uses as many as it offers.
 // must be a power of two.
-#define NUM 8
+#define NUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,13 +58,17 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // without EVENT_IDX
+
+// the ring has as many entries as there are descriptors.
 struct virtq_avail {
-  uint16 flags; // always zero
-  uint16 idx;   // driver will write ring[idx] next
-  uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT or zero
+  uint16 idx;   // driver will write ring[idx % num] next
+  uint16 ring[]; // descriptor numbers of chain heads,
+                 // then used_event (with EVENT_IDX)
 };
 
 // one entry in the "used" ring, with which the
@@ -75,18 +81,41 @@ struct virtq_used_elem {
 struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
-  struct virtq_used_elem ring[NUM];
+  struct virtq_used_elem ring[]; // then avail_event (with EVENT_IDX)
 };
 
+// bytes of ring memory for a queue of n descriptors, laid out
+// as in Section 2.6.2 of the spec, with the used ring aligned
+// to a page.
+#define VRING_AVAIL_OFF(n) ((n) * sizeof(struct virtq_desc))
+#define VRING_USED_OFF(n) \
+  PGROUNDUP(VRING_AVAIL_OFF(n) + sizeof(struct virtq_avail) + ((n)+1) * sizeof(uint16))
+#define VRING_SIZE(n) \
+  PGROUNDUP(VRING_USED_OFF(n) + sizeof(struct virtq_used) + \
+            (n) * sizeof(struct virtq_used_elem) + sizeof(uint16))
+
+// with EVENT_IDX, does a side that last heard about index old,
+// and has now moved on to new, need to tell the other side,
+// which asked to hear once it gets past event?
+#define VRING_NEED_EVENT(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
+// offset of the uint16 num_queues in the block device's
+// configuration, present with VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
+// most blocks moved by one disk request.
+#define NVEC 16
+
 // the format of the first descriptor in a disk request.
-// to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// to be followed by descriptors for each block's data,
+// and one for a one-byte status.
 struct virtio_blk_req {
   uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
   uint32 reserved;
@@ -3,7 +3,15 @@
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
+//
+// if the device offers more than one queue (VIRTIO_BLK_F_MQ),
+// each hart submits its requests on a queue of its own, with
+// its own lock, elevator, and book-keeping, so harts doing I/O
+// at once don't contend. a process waits for and completes its
+// requests on the queue it used, mostly by polling; the device
+// has just one interrupt, which reaps every queue, starting
+// with the interrupted hart's own.
 //
 
 #include "types.h"
@@ -16,16 +24,29 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "bstat.h"
+#include "elevator.h"
+
+// most requests the device has at once, per queue. the rest
+// wait in the queue's elevator, which sorts and merges them.
+#define QDEPTH 8
+
+// how long, in CLINT mtime units (10 MHz under qemu), a
+// process waiting for the disk polls for its request to
+// finish before it sleeps until the disk interrupts.
+#define DISKPOLL 1000
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue.
+static struct vq {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // contiguous pages of page-aligned physical memory, enough for the
+  // biggest queue the driver will use.
+  char pages[VRING_SIZE(NUM)];
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -34,7 +55,7 @@ static struct disk {
   
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
-  // and write individual disk operations. there are NUM descriptors.
+  // and write individual disk operations. there are num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   // points into pages[].
@@ -43,43 +64,98 @@ static struct disk {
   // next is a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   // points into pages[].
   struct virtq_avail *avail;
 
   // finally a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   // points into pages[].
   struct virtq_used *used;
 
   // our own book-keeping.
+  int id;          // queue number
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;       // how many are
+  int inflight;    // requests the device has
+  struct elevator elv; // requests waiting for the device
+  uint16 used_idx; // we've looked this far in used[2..num].
+  uint16 kicked;   // avail->idx when we last notified the device.
+
+  // while processes are polling the used ring,
+  // the queue's interrupts are turned off.
+  int npoll;         // processes polling
+  uint64 nintrdone;  // requests completed by the interrupt handler
+  uint64 npolldone;  // requests completed by processes
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[NVEC];
+    int n;
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // with VIRTIO_RING_F_INDIRECT_DESC, each request's
+  // descriptors go in a table, indexed like ops[],
+  // and take up only one of desc[].
+  struct virtq_desc indirect_desc[NUM][NVEC+2] __attribute__ ((aligned (16)));
   
-  struct spinlock vdisk_lock;
+  struct spinlock lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE))) vq[NCPU];
+
+static struct disk {
+  int nq;          // queues in use
+  int num;         // descriptors per queue: NUM, or fewer if the device says
+  int maxvec;      // most blocks in a request: NVEC, or fewer to fit
+
+  // negotiated features.
+  int indirect;    // VIRTIO_RING_F_INDIRECT_DESC
+  int event_idx;   // VIRTIO_RING_F_EVENT_IDX
+
+  uint64 nintr;    // interrupts taken; atomic
+} disk;
+
+static void
+virtio_disk_initq(struct vq *q, int id)
+{
+  initlock(&q->lock, "virtio_disk");
+  q->id = id;
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = id;
+  if(*R(VIRTIO_MMIO_QUEUE_NUM_MAX) < disk.num)
+    panic("virtio disk queues differ");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
+  *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
+  memset(q->pages, 0, sizeof(q->pages));
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
+
+  // desc = pages -- num * virtq_desc
+  // avail = pages + num*16 -- 2 * uint16, then num+1 * uint16
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem, then uint16
+
+  q->desc = (struct virtq_desc *) q->pages;
+  q->avail = (struct virtq_avail *)(q->pages + VRING_AVAIL_OFF(disk.num));
+  q->used = (struct virtq_used *) (q->pages + VRING_USED_OFF(disk.num));
+
+  // all num descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
+    q->free[i] = 1;
+  q->nfree = disk.num;
+}
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -98,11 +174,19 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+
+  // one queue per hart, if the device has enough.
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+  if(disk.nq > NCPU)
+    disk.nq = NCPU;
+  if(disk.nq < 1)
+    disk.nq = 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -114,39 +198,36 @@ virtio_disk_init(void)
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
   *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < 8)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // legacy queue sizes are powers of two.
+  for(disk.num = NUM; disk.num > max; disk.num /= 2)
+    ;
 
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
+  for(int i = 0; i < disk.nq; i++)
+    virtio_disk_initq(&vq[i], i);
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // without indirect descriptors, a request's
+  // n+2 descriptors must all fit in the ring.
+  disk.maxvec = NVEC;
+  if(!disk.indirect && disk.maxvec > disk.num - 2)
+    disk.maxvec = disk.num - 2;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *q)
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+  for(int i = 0; i < disk.num; i++){
+    if(q->free[i]){
+      q->free[i] = 0;
+      q->nfree--;
       return i;
     }
   }
@@ -155,28 +236,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *q, int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  q->nfree++;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +265,91 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(struct vq *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+static void
+set_desc(struct virtq_desc *d, uint64 addr, uint32 len, uint16 flags, uint16 next)
+{
+  d->addr = addr;
+  d->len = len;
+  d->flags = flags;
+  d->next = next;
+}
+
+// tell the device about requests added to the avail ring
+// since we last did, unless, with EVENT_IDX, it has said
+// it will find them without being told. a notification is
+// an exit to the hypervisor, so submitting several requests
+// and then kicking once is cheaper than kicking for each.
+static void
+kick(struct vq *q)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint16 old = q->kicked, new = q->avail->idx;
 
-  acquire(&disk.vdisk_lock);
+  if(old == new)
+    return;
+  q->kicked = new;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // the device must see the new avail->idx before
+  // we read what it last said about avail_event.
+  __sync_synchronize();
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  if(disk.event_idx){
+    uint16 event = *(volatile uint16 *)&q->used->ring[disk.num];
+    if(!VRING_NEED_EVENT(event, new, old))
+      return;
+  }
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->id; // value is queue number
+}
+
+// start one request for the n bufs in b[], which hold
+// consecutive blocks, and put it on the avail ring; kick()
+// tells the device about it. dispatch() has checked that
+// there are enough free descriptors.
+// caller holds q->lock.
+static void
+virtio_disk_start(struct vq *q, struct buf **b, int n, int write)
+{
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
+  struct virtq_desc *d;
+  int idx[NVEC+2], chain[NVEC+2];
+  int i, nd;
+
+  // the spec's Section 5.2 says that legacy block operations use
+  // a descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result. with indirect
+  // descriptors, those go in a table that takes up just one
+  // descriptor in the ring.
+  nd = disk.indirect ? 1 : n + 2;
+  if(allocn_desc(q, idx, nd) < 0)
+    panic("virtio_disk_start");
+  if(disk.indirect){
+    d = q->indirect_desc[idx[0]];
+    for(i = 0; i < n + 2; i++)
+      chain[i] = i;
+  } else {
+    d = q->desc;
+    for(i = 0; i < n + 2; i++)
+      chain[i] = idx[i];
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,57 +358,213 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  set_desc(&d[chain[0]], (uint64) buf0, sizeof(struct virtio_blk_req),
+           VRING_DESC_F_NEXT, chain[1]);
+  for(i = 0; i < n; i++){
+    // device reads b->data for a write, writes it for a read.
+    set_desc(&d[chain[i+1]], (uint64) b[i]->data, BSIZE,
+             (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT, chain[i+2]);
+  }
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  set_desc(&d[chain[n+1]], (uint64) &q->info[idx[0]].status, 1,
+           VRING_DESC_F_WRITE, 0); // device writes the status
+  if(disk.indirect)
+    set_desc(&q->desc[idx[0]], (uint64) d, (n+2) * sizeof(struct virtq_desc),
+             VRING_DESC_F_INDIRECT, 0);
+
+  // record struct bufs for virtio_disk_intr().
+  for(i = 0; i < n; i++)
+    q->info[idx[0]].b[i] = b[i];
+  q->info[idx[0]].n = n;
+  q->inflight++;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % num ...
+}
 
-  __sync_synchronize();
+// send waiting requests to the device, in the order the
+// elevator picks, while it has fewer than QDEPTH and there
+// are descriptors for them. caller holds q->lock.
+static void
+dispatch(struct vq *q)
+{
+  struct buf *b[NVEC];
+  int n, write;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  while(q->inflight < QDEPTH && q->nfree >= (disk.indirect ? 1 : disk.maxvec + 2)){
+    n = elv_next(&q->elv, b, disk.maxvec, &write, *(uint64*)CLINT_MTIME);
+    if(n == 0)
+      break;
+    virtio_disk_start(q, b, n, write);
+  }
+  kick(q);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// complete the requests the device has put on the used ring
+// since we last looked, and return how many there were.
+// caller holds q->lock.
+static int
+reap(struct vq *q)
+{
+  int nreq = 0;
+
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
+
+  while(q->used_idx != *(volatile uint16 *)&q->used->idx){
+    __sync_synchronize();
+    int id = q->used->ring[q->used_idx % disk.num].id;
+
+    if(q->info[id].status != 0)
+      panic("virtio_disk status");
+
+    int n = q->info[id].n;
+    q->info[id].n = 0;
+    free_chain(q, id);
+    for(int i = 0; i < n; i++){
+      struct buf *b = q->info[id].b[i];
+      b->disk = 0;   // disk is done with buf
+      if(b->iodone)
+        b->iodone(b);
+      else
+        wakeup(b);
+    }
+
+    q->used_idx += 1;
+    q->inflight--;
+    nreq++;
   }
+  if(nreq > 0)
+    dispatch(q);
+  return nreq;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// turn the device's completion interrupts on or off. when
+// turning them on, complete anything that finished while they
+// were off, for which there will be no interrupt, and return
+// how many requests that was. caller holds q->lock.
+static int
+interrupts(struct vq *q, int on)
+{
+  int n = 0;
+
+  if(!on){
+    // with EVENT_IDX, the device interrupts only once used->idx
+    // passes used_event; put that as far off as it can be.
+    if(disk.event_idx)
+      *(volatile uint16 *)&q->avail->ring[disk.num] = q->used_idx + 0x8000;
+    else
+      q->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    return 0;
+  }
 
-  release(&disk.vdisk_lock);
+  q->avail->flags = 0;
+  while(1){
+    // ask to hear about the next completion.
+    if(disk.event_idx)
+      *(volatile uint16 *)&q->avail->ring[disk.num] = q->used_idx;
+    __sync_synchronize();
+    int r = reap(q);
+    if(r == 0)
+      break;
+    n += r;
+  }
+  return n;
+}
+
+// the queue this hart submits on.
+static struct vq*
+myvq(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &vq[id % disk.nq];
+}
+
+// start reading or writing the n bufs in b[], and return
+// without waiting for the disk. they go to the elevator
+// of this hart's queue, which merges bufs for consecutive
+// blocks into requests of up to NVEC blocks. when a buf's
+// request finishes, virtio_disk_intr() calls b->iodone(b)
+// if it is set, and otherwise wakes up virtio_disk_wait(b).
+// b->disk is 1 until then.
+void
+virtio_disk_submitv(struct buf **b, int n, int write)
+{
+  uint64 now = *(uint64*)CLINT_MTIME;
+  struct vq *q = myvq();
+
+  acquire(&q->lock);
+  // make room for more of them, if anything has finished.
+  q->npolldone += reap(q);
+  for(int i = 0; i < n; i++){
+    b[i]->disk = 1;
+    b[i]->diskq = q->id;
+    elv_add(&q->elv, b[i], write, now);
+  }
+  dispatch(q);
+  release(&q->lock);
+}
+
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
+
+// wait for the request virtio_disk_submit() started
+// for b to finish. b->iodone must not be set.
+// a disk request often finishes within microseconds, less
+// than a trip through the interrupt handler, sleep() and
+// wakeup() takes, so poll the used ring for a while first,
+// with the queue's interrupts off.
+void
+virtio_disk_wait(struct buf *b)
+{
+  uint64 start = *(uint64*)CLINT_MTIME;
+  struct vq *q = &vq[b->diskq];
+
+  acquire(&q->lock);
+  if(b->disk == 1){
+    if(q->npoll++ == 0)
+      interrupts(q, 0);
+    while(b->disk == 1 && *(uint64*)CLINT_MTIME - start < DISKPOLL){
+      release(&q->lock);
+      while(*(volatile uint16 *)&q->used->idx == *(volatile uint16 *)&q->used_idx &&
+            *(uint64*)CLINT_MTIME - start < DISKPOLL)
+        ;
+      acquire(&q->lock);
+      q->npolldone += reap(q);
+    }
+    if(--q->npoll == 0)
+      q->npolldone += interrupts(q, 1);
+  }
+  while(b->disk == 1) {
+    sleep(b, &q->lock);
+  }
+  release(&q->lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct vq *q;
+  int first = cpuid() % disk.nq;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -294,22 +576,31 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  __atomic_fetch_add(&disk.nintr, 1, __ATOMIC_RELAXED);
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  // the interrupt doesn't say which queue it is for.
+  for(int i = 0; i < disk.nq; i++){
+    q = &vq[(first + i) % disk.nq];
+    acquire(&q->lock);
+    q->nintrdone += reap(q);
+    if(q->npoll == 0)
+      q->nintrdone += interrupts(q, 1);
+    release(&q->lock);
   }
+}
 
-  release(&disk.vdisk_lock);
+// report interrupt and completion counts.
+void
+virtio_disk_stat(struct bstat *st)
+{
+  struct vq *q;
+
+  st->ndiskintr = __atomic_load_n(&disk.nintr, __ATOMIC_RELAXED);
+  st->nintrdone = st->npolldone = 0;
+  for(q = vq; q < vq + disk.nq; q++){
+    acquire(&q->lock);
+    st->nintrdone += q->nintrdone;
+    st->npolldone += q->npolldone;
+    release(&q->lock);
+  }
 }
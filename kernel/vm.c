@@ -27,6 +27,10 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, so that tickless mode can read mtime and
+  // reprogram this hart's mtimecmp from supervisor mode.
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -130,6 +134,45 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// bumped whenever a kernel stack is unmapped. scheduler()
+// flushes its hart's TLB before running a process if this
+// has changed, since the stack's address may have been reused.
+uint kstackgen;
+
+// Map a newly allocated page as the kernel stack at va.
+// proc_mapstacks() already made the page-table pages,
+// so this doesn't allocate any.
+// Returns 0 on success, -1 if out of memory.
+int
+kvmmapstack(uint64 va)
+{
+  char *pa;
+  pte_t *pte;
+
+  if((pa = kalloc()) == 0)
+    return -1;
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V))
+    panic("kvmmapstack");
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+  return 0;
+}
+
+// Unmap and free the kernel stack at va, if there is one.
+void
+kvmunmapstack(uint64 va)
+{
+  pte_t *pte;
+
+  if((pte = walk(kernel_pagetable, va, 0)) == 0)
+    panic("kvmunmapstack");
+  if((*pte & PTE_V) == 0)
+    return;
+  kfree((void*)PTE2PA(*pte));
+  *pte = 0;
+  sfence_vma();
+  __sync_fetch_and_add(&kstackgen, 1);
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
@@ -215,6 +258,18 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
   memmove(mem, src, sz);
 }
 
+// Allocate a page for user memory. If memory is short,
+// the buffer cache may be able to give some back.
+static char*
+uvmkalloc(void)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0 && bshrink() > 0)
+    mem = kalloc();
+  return mem;
+}
+
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 uint64
@@ -228,7 +283,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = uvmkalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -312,7 +367,7 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
       panic("uvmcopy: page not present");
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if((mem = uvmkalloc()) == 0)
       goto err;
     memmove(mem, (char*)pa, PGSIZE);
     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
@@ -343,6 +398,10 @@ uvmclear(pagetable_t pagetable, uint64 va)
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
+// Each page is looked up and copied with interrupts off: a thread
+// shrinking a shared address space frees pages only after every
+// other hart using it has taken tlbshootdown()'s interrupt, so
+// none can be part way through copying one of them.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
@@ -350,13 +409,17 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
+    push_off();
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -368,6 +431,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
+// Interrupts are off for each page, as in copyout().
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
@@ -375,13 +439,17 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
+    push_off();
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -394,6 +462,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
 // Return 0 on success, -1 on error.
+// Interrupts are off for each page, as in copyout().
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
@@ -402,9 +471,12 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
+    push_off();
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -423,6 +495,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -20,15 +20,16 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+uint fssize = FSSIZE;  // Size of the file system in blocks (-s)
+uint ninodes = NINODES; // Number of inodes (-i)
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE;   // Number of log blocks, header included (-l)
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -41,6 +42,7 @@ void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
 void die(const char *);
+void usage(void);
 
 // convert to intel byte order
 ushort
@@ -68,7 +70,7 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, opt;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -77,38 +79,62 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  while((opt = getopt(argc, argv, "s:i:l:")) != -1){
+    switch(opt){
+    case 's':
+      fssize = strtoul(optarg, 0, 0);
+      break;
+    case 'i':
+      ninodes = strtoul(optarg, 0, 0);
+      break;
+    case 'l':
+      nlog = strtoul(optarg, 0, 0);
+      break;
+    default:
+      usage();
+    }
   }
+  argc -= optind;
+  argv += optind;
+  if(argc < 1)
+    usage();
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  fsfd = open(argv[0], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
-    die(argv[1]);
+    die(argv[0]);
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(nlog < 2 || ninodes < 2 || nmeta >= fssize){
+    fprintf(stderr, "mkfs: %u blocks is too small for %u inodes and %d log blocks\n",
+            fssize, ninodes, nlog);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %u\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // a sparse file of zeroes, so that making a large file
+  // system image writes only the blocks that aren't zero.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die("ftruncate");
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -127,7 +153,7 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
-  for(i = 2; i < argc; i++){
+  for(i = 1; i < argc; i++){
     // get rid of "user/"
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
@@ -163,7 +189,7 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1) / BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -175,7 +201,7 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE)
     die("lseek");
   if(write(fsfd, buf, BSIZE) != BSIZE)
     die("write");
@@ -211,7 +237,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE)
     die("lseek");
   if(read(fsfd, buf, BSIZE) != BSIZE)
     die("read");
@@ -223,6 +249,7 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < ninodes);
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -235,16 +262,18 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used <= fssize);
+  for(b = 0; b * BSIZE*8 < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BSIZE*8 && b * BSIZE*8 + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -253,11 +282,11 @@ void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, bn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
+  int i;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -265,22 +294,30 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+    // find the extent holding fbn. mkfs writes one file at
+    // a time, so files have few extents, and it never
+    // needs an extent tree.
+    bn = fbn;
+    for(i = 0; i < NEXTENT && xint(din.ext[i].len) > 0; i++){
+      if(bn < xint(din.ext[i].len))
+        break;
+      bn -= xint(din.ext[i].len);
+    }
+    if(i == NEXTENT || xint(din.ext[i].len) == 0){
+      // fbn is just past the end of the file.
+      if(i > 0 && xint(din.ext[i-1].addr) + xint(din.ext[i-1].len) == freeblock){
+        i--;
+        bn = xint(din.ext[i].len);
+        din.ext[i].len = xint(bn + 1);
+      } else {
+        assert(i < NEXTENT);
+        din.ext[i].addr = xint(freeblock);
+        din.ext[i].len = xint(1);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      freeblock++;
+      assert(freeblock <= fssize);
     }
+    x = xint(din.ext[i].addr) + bn;
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -293,6 +330,13 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-s blocks] [-i inodes] [-l logblocks] fs.img files...\n");
+  exit(1);
+}
+
 void
 die(const char *s)
 {
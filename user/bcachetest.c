@@ -0,0 +1,114 @@
+// Buffer cache contention benchmark.
+//
+// Several processes repeatedly read the same small files, so
+// every bread() hits in the cache, and the report shows how
+// much they contended for the buffer cache's locks (using
+// lockstat()) and how long they took.
+//
+//   bcachetest [nproc]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define NFILE   4   // files, one per reader at most
+#define NBLOCK  4   // blocks per file
+#define ROUNDS  500
+
+char buf[BSIZE];
+
+void
+makefile(char *name)
+{
+  int fd;
+
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+    printf("bcachetest: create %s failed\n", name);
+    exit(1);
+  }
+  for(int i = 0; i < NBLOCK; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachetest: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+reader(char *name)
+{
+  int fd;
+
+  for(int i = 0; i < ROUNDS; i++){
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("bcachetest: open %s failed\n", name);
+      exit(1);
+    }
+    while(read(fd, buf, sizeof(buf)) == sizeof(buf))
+      ;
+    close(fd);
+  }
+  exit(0);
+}
+
+// Sum lockstat() counts for the buffer cache's locks.
+void
+bcachestat(uint64 *nacquire, uint64 *nspin)
+{
+  struct lockstat ls[NLOCKSTAT];
+  int n;
+
+  *nacquire = *nspin = 0;
+  n = lockstat(ls, NLOCKSTAT);
+  for(int i = 0; i < n; i++){
+    if(strcmp(ls[i].name, "bcache") == 0 || strcmp(ls[i].name, "bcache.bucket") == 0){
+      *nacquire += ls[i].nacquire;
+      *nspin += ls[i].nspin;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char name[] = "bcachetest.0";
+  int nproc = NFILE, start;
+  uint64 nacquire, nspin;
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+
+  for(int i = 0; i < NFILE; i++){
+    name[sizeof(name)-2] = '0' + i;
+    makefile(name);
+  }
+
+  lockstat(0, 0);
+  start = uptime();
+  for(int i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bcachetest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      name[sizeof(name)-2] = '0' + i % NFILE;
+      reader(name);
+    }
+  }
+  for(int i = 0; i < nproc; i++)
+    wait(0);
+  bcachestat(&nacquire, &nspin);
+  printf("bcachetest: %d readers, %d ticks, bcache locks: %l acquires, %l spins\n",
+         nproc, uptime() - start, nacquire, nspin);
+
+  for(int i = 0; i < NFILE; i++){
+    name[sizeof(name)-2] = '0' + i;
+    unlink(name);
+  }
+  exit(0);
+}
@@ -0,0 +1,48 @@
+// Print buffer cache hit and miss counts, and
+// how disk requests were completed.
+//
+//   bstat [command [arg ...]]
+//
+// With a command, runs it and reports only the
+// lookups it caused, e.g. "bstat grep x README".
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/bstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct bstat before, after;
+  uint64 n;
+
+  memset(&before, 0, sizeof(before));
+  if(argc > 1){
+    bstat(&before);
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "bstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "bstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if(bstat(&after) < 0){
+    fprintf(2, "bstat: failed\n");
+    exit(1);
+  }
+
+  n = (after.nhit - before.nhit) + (after.nmiss - before.nmiss);
+  printf("hits %l misses %l hit rate %l%%\n", after.nhit - before.nhit,
+         after.nmiss - before.nmiss, n ? (after.nhit - before.nhit) * 100 / n : 0);
+  printf("buffers %d, growing to %d\n", after.nbuf, after.ntarget);
+  printf("disk interrupts %l, requests completed by interrupt %l, by polling %l\n",
+         after.ndiskintr - before.ndiskintr, after.nintrdone - before.nintrdone,
+         after.npolldone - before.npolldone);
+  exit(0);
+}
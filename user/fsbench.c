@@ -0,0 +1,121 @@
+// Large file system benchmark.
+//
+//   fsbench [MB] [nfile]
+//
+// Writes a file of MB megabytes (default 4) and reads it back,
+// then creates nfile empty files (default 500) and removes
+// them, reporting the time each step takes. Run it on a large
+// file system, where allocating blocks and inodes used to scan
+// the whole bitmap and inode table:
+//
+//   rm fs.img; make FSSIZE=1048576 NINODES=16384 qemu
+//   $ fsbench 64 2000
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define DIR  "fsbench.d"
+#define FILE "fsbench.f"
+
+char buf[8*BSIZE];
+
+void
+report(char *what, uint64 kb, int ticks)
+{
+  printf("fsbench: %s %d KB in %d ticks", what, (int)kb, ticks);
+  if(ticks > 0)
+    printf(", %d KB/s", (int)(kb * TICKHZ / ticks));
+  printf("\n");
+}
+
+void
+name(char *s, int i)
+{
+  strcpy(s, DIR "/f");
+  s += strlen(s);
+  for(int d = 1000; d > 0; d /= 10)
+    *s++ = '0' + i / d % 10;
+  *s = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, mb = 4, nfile = 500, start, n;
+  uint64 total;
+  char path[32];
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(argc > 2)
+    nfile = atoi(argv[2]);
+  if(nfile > 10000)
+    nfile = 10000;
+  total = (uint64)mb * 1024 * 1024;
+
+  for(int i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  if((fd = open(FILE, O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    fprintf(2, "fsbench: create %s failed\n", FILE);
+    exit(1);
+  }
+  start = uptime();
+  for(uint64 off = 0; off < total; off += sizeof(buf)){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      fprintf(2, "fsbench: write failed at %d KB\n", (int)(off / 1024));
+      exit(1);
+    }
+  }
+  close(fd);
+  report("write", total / 1024, uptime() - start);
+
+  if((fd = open(FILE, O_RDONLY)) < 0){
+    fprintf(2, "fsbench: open %s failed\n", FILE);
+    exit(1);
+  }
+  start = uptime();
+  for(uint64 off = 0; off < total; off += n){
+    if((n = read(fd, buf, sizeof(buf))) <= 0){
+      fprintf(2, "fsbench: read failed at %d KB\n", (int)(off / 1024));
+      exit(1);
+    }
+  }
+  close(fd);
+  report("read", total / 1024, uptime() - start);
+
+  start = uptime();
+  unlink(FILE);
+  printf("fsbench: unlink %d MB in %d ticks\n", mb, uptime() - start);
+
+  if(mkdir(DIR) < 0){
+    fprintf(2, "fsbench: mkdir %s failed\n", DIR);
+    exit(1);
+  }
+  start = uptime();
+  for(int i = 0; i < nfile; i++){
+    name(path, i);
+    if((fd = open(path, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "fsbench: create %s failed\n", path);
+      exit(1);
+    }
+    close(fd);
+  }
+  printf("fsbench: create %d files in %d ticks\n", nfile, uptime() - start);
+
+  start = uptime();
+  for(int i = 0; i < nfile; i++){
+    name(path, i);
+    if(unlink(path) < 0){
+      fprintf(2, "fsbench: unlink %s failed\n", path);
+      exit(1);
+    }
+  }
+  printf("fsbench: unlink %d files in %d ticks\n", nfile, uptime() - start);
+  unlink(DIR);
+
+  exit(0);
+}
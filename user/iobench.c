@@ -0,0 +1,150 @@
+// Disk write throughput benchmark, for comparing the
+// elevator with IOSCHED=noop.
+//
+//   iobench [nproc]
+//
+// nproc processes (default 4) write at once, so that their
+// transactions commit together and the log installs many
+// blocks per commit. In the sequential test, each appends
+// to its own file; in the random test, each overwrites
+// one-block files chosen at random, whose blocks are spread
+// over the disk.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define NSEQ    50   // blocks each process appends
+#define NRAND   50   // blocks each process overwrites
+#define NRFILE   32   // files for the random test
+
+char buf[BSIZE];
+
+void
+name(char *s, char c, int i)
+{
+  s[0] = 'i';
+  s[1] = 'o';
+  s[2] = c;
+  s[3] = '0' + i / 10;
+  s[4] = '0' + i % 10;
+  s[5] = 0;
+}
+
+void
+writeblock(char *file, int flags)
+{
+  int fd;
+
+  if((fd = open(file, flags)) < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("iobench: write %s failed\n", file);
+    exit(1);
+  }
+  close(fd);
+}
+
+void
+seqwriter(int i)
+{
+  char file[6];
+  int fd;
+
+  name(file, 's', i);
+  if((fd = open(file, O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    printf("iobench: create %s failed\n", file);
+    exit(1);
+  }
+  for(int b = 0; b < NSEQ; b++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("iobench: write %s failed\n", file);
+      exit(1);
+    }
+  }
+  close(fd);
+  exit(0);
+}
+
+void
+randwriter(int i)
+{
+  uint seed = 12345 + i * 7919;
+  char file[6];
+
+  for(int b = 0; b < NRAND; b++){
+    seed = seed * 1103515245 + 12345;
+    name(file, 'r', (seed >> 16) % NRFILE);
+    writeblock(file, O_WRONLY);
+  }
+  exit(0);
+}
+
+// Run nproc copies of writer at once; return how many ticks it took.
+int
+run(void (*writer)(int), int nproc)
+{
+  int start = uptime();
+
+  for(int i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("iobench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      writer(i);
+  }
+  for(int i = 0; i < nproc; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  return uptime() - start;
+}
+
+void
+report(char *what, int nblock, int ticks)
+{
+  printf("iobench: %s: %d blocks in %d ticks", what, nblock, ticks);
+  if(ticks > 0)
+    printf(", %d blocks/s", nblock * TICKHZ / ticks);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 4, ticks;
+  char file[6];
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(nproc < 1 || nproc > 10){
+    printf("usage: iobench [nproc (1-10)]\n");
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+
+  ticks = run(seqwriter, nproc);
+  report("sequential", nproc * NSEQ, ticks);
+  for(int i = 0; i < nproc; i++){
+    name(file, 's', i);
+    unlink(file);
+  }
+
+  for(int i = 0; i < NRFILE; i++){
+    name(file, 'r', i);
+    writeblock(file, O_CREATE|O_WRONLY);
+  }
+  ticks = run(randwriter, nproc);
+  report("random", nproc * NRAND, ticks);
+  for(int i = 0; i < NRFILE; i++){
+    name(file, 'r', i);
+    unlink(file);
+  }
+
+  exit(0);
+}
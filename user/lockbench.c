@@ -0,0 +1,115 @@
+// Kernel spinlock contention benchmark.
+//
+// Runs 1, 2, 4 and 8 processes that each hammer one hot kernel
+// lock through a system call, and reports the elapsed ticks and
+// how far apart the first and last process finished; the spread
+// shows how fair the lock is. Compare kernels built with
+// SPINLOCK=ticket, SPINLOCK=mcs, and the default test-and-set.
+//
+//   lockbench [iterations]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define MAXPROC 8
+
+int iters = 20000;
+
+// kmem.lock: allocate and free a page.
+void
+kmem(void)
+{
+  for(int i = 0; i < iters; i++){
+    char *a = sbrk(4096);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("lockbench: sbrk failed\n");
+      exit(1);
+    }
+    a[0] = 1;
+    sbrk(-4096);
+  }
+}
+
+// tickslock.
+void
+ticks(void)
+{
+  for(int i = 0; i < iters; i++)
+    uptime();
+}
+
+// ftable.lock, and itable.lock via the inode of ".".
+void
+files(void)
+{
+  for(int i = 0; i < iters / 4; i++){
+    int fd = open(".", O_RDONLY);
+    if(fd < 0){
+      printf("lockbench: open failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+}
+
+struct {
+  char *name;
+  void (*fn)(void);
+} workloads[] = {
+  { "kmem", kmem },
+  { "ticks", ticks },
+  { "files", files },
+};
+
+void
+run(char *name, void (*fn)(void), int nproc)
+{
+  int fds[2], start, first, last, t;
+
+  if(pipe(fds) < 0){
+    printf("lockbench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime();
+  for(int i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("lockbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      fn();
+      t = uptime();
+      write(fds[1], &t, sizeof(t));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  first = last = -1;
+  while(read(fds[0], &t, sizeof(t)) == sizeof(t)){
+    if(first < 0 || t < first)
+      first = t;
+    if(t > last)
+      last = t;
+  }
+  close(fds[0]);
+  for(int i = 0; i < nproc; i++)
+    wait(0);
+  printf("%s\tnproc %d\t%d ticks\tspread %d ticks\n",
+         name, nproc, last - start, last - first);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1)
+    iters = atoi(argv[1]);
+
+  for(int w = 0; w < sizeof(workloads)/sizeof(workloads[0]); w++)
+    for(int nproc = 1; nproc <= MAXPROC; nproc *= 2)
+      run(workloads[w].name, workloads[w].fn, nproc);
+  exit(0);
+}
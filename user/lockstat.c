@@ -0,0 +1,56 @@
+// Print the most contended kernel spinlocks, and how
+// waits for sleeplocks went.
+//
+//   lockstat [-n N] [command [arg ...]]
+//
+// With a command, resets the kernel's lock counts, runs the
+// command, and reports on the locks it used; e.g.
+// "lockstat usertests" or "lockstat -n 5 grind".
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct lockstat ls[NLOCKSTAT];
+  struct sleepstat before, after;
+  int n = 10, i, pid;
+
+  if(argc > 2 && strcmp(argv[1], "-n") == 0){
+    n = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
+  memset(&before, 0, sizeof(before));
+  if(argc > 1){
+    lockstat(0, 0);
+    sleepstat(&before);
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+
+  if((n = lockstat(ls, n)) < 0 || sleepstat(&after) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+  printf("lock\t\tacquires\tspins\tspins/acquire\n");
+  for(i = 0; i < n; i++)
+    printf("%s\t\t%l\t\t%l\t%l\n", ls[i].name, ls[i].nacquire,
+           ls[i].nspin, ls[i].nspin / ls[i].nacquire);
+  printf("sleeplock waits: %l spun, %l slept\n",
+         after.nspin - before.nspin, after.nsleep - before.nsleep);
+  exit(0);
+}
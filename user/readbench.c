@@ -0,0 +1,76 @@
+// Sequential read throughput benchmark.
+//
+//   readbench [passes]
+//
+// Writes a file, then reads it start to end the way cat and
+// wc do, 512 bytes per read(), counting lines, and reports the
+// throughput. Build the kernel with a large BCACHEFRAC (e.g.
+// BCACHEFRAC=2048) so the file doesn't fit in the buffer cache
+// and every pass reads it from disk, and compare a kernel built
+// with READAHEAD=0, which turns read-ahead off.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define NBLOCK 200   // blocks in the file
+#define FILE   "readbench.f"
+
+char buf[BSIZE];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, npass = 10, lines;
+  uint64 bytes = 0;
+  int start, ticks;
+
+  if(argc > 1)
+    npass = atoi(argv[1]);
+
+  for(int i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  if((fd = open(FILE, O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    fprintf(2, "readbench: create %s failed\n", FILE);
+    exit(1);
+  }
+  for(int i = 0; i < NBLOCK; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      fprintf(2, "readbench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  start = uptime();
+  for(int p = 0; p < npass; p++){
+    if((fd = open(FILE, O_RDONLY)) < 0){
+      fprintf(2, "readbench: open %s failed\n", FILE);
+      exit(1);
+    }
+    lines = 0;
+    while((n = read(fd, buf, 512)) > 0){
+      bytes += n;
+      for(int i = 0; i < n; i++)
+        if(buf[i] == '\n')
+          lines++;
+    }
+    close(fd);
+    if(lines != NBLOCK * BSIZE / 64){
+      fprintf(2, "readbench: read %d lines, expected %d\n", lines, NBLOCK * BSIZE / 64);
+      exit(1);
+    }
+  }
+  ticks = uptime() - start;
+
+  printf("readbench: %d KB in %d ticks", (int)(bytes / 1024), ticks);
+  if(ticks > 0)
+    printf(", %d KB/s", (int)(bytes * TICKHZ / 1024 / ticks));
+  printf("\n");
+
+  unlink(FILE);
+  exit(0);
+}
@@ -0,0 +1,144 @@
+// Buffer cache scan-resistance benchmark.
+//
+// Mixes a metadata-heavy workload (opening and stat()ing many
+// small files) with sequential reads of a large file, and
+// reports the buffer cache's hit rate for the metadata work
+// alone, then with the scan. A scan-resistant policy keeps the
+// second rate close to the first. Compare kernels built with
+// and without BCACHE=2q; build with e.g. BCACHEFRAC=2048 so the
+// cache is smaller than the big file.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/bstat.h"
+#include "user/user.h"
+
+#define NSMALL  40   // small files
+#define NBIG    200  // blocks in the big file
+#define ROUNDS  20
+
+char buf[BSIZE];
+int bigfd;
+
+void
+smallname(char *name, int i)
+{
+  name[0] = 's';
+  name[1] = '0' + i / 10;
+  name[2] = '0' + i % 10;
+  name[3] = 0;
+}
+
+void
+setup(void)
+{
+  char name[4];
+  int fd;
+
+  if(mkdir("scanbench.d") < 0 || chdir("scanbench.d") < 0){
+    printf("scanbench: mkdir failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0 || write(fd, "x", 1) != 1){
+      printf("scanbench: create %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  if((fd = open("big", O_CREATE|O_WRONLY)) < 0){
+    printf("scanbench: create big failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < NBIG; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("scanbench: write big failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+metadata(void)
+{
+  char name[4];
+  struct stat st;
+  int fd;
+
+  for(int i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+      printf("scanbench: open %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+}
+
+// Read a tenth of the big file, continuing where
+// the last call left off.
+void
+scan(void)
+{
+  for(int i = 0; i < NBIG / 10; i++){
+    if(read(bigfd, buf, sizeof(buf)) != sizeof(buf)){
+      close(bigfd);
+      if((bigfd = open("big", O_RDONLY)) < 0){
+        printf("scanbench: reopen big failed\n");
+        exit(1);
+      }
+    }
+  }
+}
+
+void
+report(char *what, struct bstat *a, struct bstat *b)
+{
+  uint64 hit = b->nhit - a->nhit, miss = b->nmiss - a->nmiss;
+
+  printf("scanbench: %s: %l hits, %l misses, hit rate %l%%\n",
+         what, hit, miss, hit + miss ? hit * 100 / (hit + miss) : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bstat a, b;
+  char name[4];
+
+  setup();
+
+  metadata();
+  bstat(&a);
+  for(int r = 0; r < ROUNDS; r++)
+    metadata();
+  bstat(&b);
+  report("metadata alone", &a, &b);
+
+  if((bigfd = open("big", O_RDONLY)) < 0){
+    printf("scanbench: open big failed\n");
+    exit(1);
+  }
+  bstat(&a);
+  for(int r = 0; r < ROUNDS; r++){
+    metadata();
+    scan();
+  }
+  bstat(&b);
+  close(bigfd);
+  report("metadata with scan", &a, &b);
+  printf("scanbench: cache has %d buffers\n", b.nbuf);
+
+  for(int i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    unlink(name);
+  }
+  unlink("big");
+  chdir("..");
+  unlink("scanbench.d");
+  exit(0);
+}
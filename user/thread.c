@@ -0,0 +1,50 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Threads on top of clone() and join(), with stacks from malloc().
+
+#define TSTACK 4096
+
+// clone() starts a thread here; a points at fn and arg,
+// just above the thread's initial stack pointer.
+static void
+thread_start(void *a)
+{
+  void **v = a;
+
+  ((void (*)(void*))v[0])(v[1]);
+  exit(0);
+}
+
+// Start a thread running fn(arg) in this address space.
+// Returns the thread's pid, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  void **v;
+  int pid;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  v = (void**)(stack + TSTACK - 16);
+  v[0] = (void*)fn;
+  v[1] = arg;
+  if((pid = clone(thread_start, v, v)) < 0)
+    free(stack);
+  return pid;
+}
+
+// Wait for one of this process's threads to exit, and
+// free its stack. Returns the thread's pid, or -1.
+int
+thread_join(void)
+{
+  char *top;
+  int pid;
+
+  if((pid = join((void**)&top)) >= 0)
+    free(top + 16 - TSTACK);
+  return pid;
+}
@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct lockstat;
+struct bstat;
+struct sleepstat;
 
 // system calls
 int fork(void);
@@ -23,6 +26,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int clone(void (*)(void*), void*, void*);
+int join(void**);
+int futex(int*, int, int);
+int lockstat(struct lockstat*, int);
+int bstat(struct bstat*);
+int sleepstat(struct sleepstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +49,22 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// thread.c
+int thread_create(void (*)(void*), void*);
+int thread_join(void);
+
+// mutex.c
+struct mutex {
+  int state;  // 0: unlocked, 1: locked, 2: locked with waiters
+};
+struct cond {
+  int seq;    // bumped by each signal or broadcast
+};
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
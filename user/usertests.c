@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/futex.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -572,6 +573,9 @@ writetest(char *s)
 void
 writebig(char *s)
 {
+  // more blocks than an inode's extents plus one
+  // level of extent blocks could map one at a time.
+  enum { N = 2*NEXTENT*NXPB };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -580,7 +584,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -600,7 +604,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -623,6 +627,57 @@ writebig(char *s)
   }
 }
 
+// two files written a block at a time in turn, so that
+// their blocks interleave on the disk and each needs more
+// extents than fit in its inode and one level of extent
+// blocks.
+void
+extents(char *s)
+{
+  enum { N = NEXTENT*NXPB + NXPB };
+  int fd[2], i, j;
+
+  for(j = 0; j < 2; j++){
+    fd[j] = open(j ? "ext1" : "ext0", O_CREATE|O_RDWR|O_TRUNC);
+    if(fd[j] < 0){
+      printf("%s: cannot create ext%d\n", s, j);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = j;
+      ((int*)buf)[1] = i;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write ext%d block %d failed\n", s, j, i);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(j ? "ext1" : "ext0", O_RDONLY);
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: read ext%d block %d failed\n", s, j, i);
+        exit(1);
+      }
+      if(((int*)buf)[0] != j || ((int*)buf)[1] != i){
+        printf("%s: ext%d block %d has %d/%d\n", s, j, i,
+               ((int*)buf)[0], ((int*)buf)[1]);
+        exit(1);
+      }
+    }
+    if(read(fd[j], buf, BSIZE) != 0){
+      printf("%s: ext%d too long\n", s, j);
+      exit(1);
+    }
+    close(fd[j]);
+  }
+  unlink("ext0");
+  unlink("ext1");
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -1512,6 +1567,99 @@ linkunlink(char *s)
     exit(0);
 }
 
+// a file spanning more bitmap groups than one transaction
+// may log, written and unlinked twice: the second write runs
+// out of disk unless unlink freed all of the first's blocks.
+void
+bigunlink(char *s)
+{
+  enum { N = 9*BSIZE*8 + BSIZE*4 };  // blocks
+  int fd, i, round;
+
+  for(round = 0; round < 2; round++){
+    fd = open("bigunlink", O_CREATE|O_WRONLY|O_TRUNC);
+    if(fd < 0){
+      printf("%s: cannot create bigunlink\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i += BUFSZ/BSIZE){
+      if(write(fd, buf, BUFSZ) != BUFSZ){
+        printf("%s: write bigunlink failed at block %d\n", s, i);
+        exit(1);
+      }
+    }
+    close(fd);
+    if(unlink("bigunlink") < 0){
+      printf("%s: unlink bigunlink failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// write a file into a free space fragmented into one-block
+// holes, so that each block is an extent of its own and every
+// write needs bitmap and extent blocks for many runs, more
+// than one transaction has room for.
+void
+fragwrite(char *s)
+{
+  enum { N = 1000 };  // blocks
+  int fda, fdb, fd, i, j;
+
+  fda = open("fraga", O_CREATE|O_WRONLY|O_TRUNC);
+  fdb = open("fragb", O_CREATE|O_WRONLY|O_TRUNC);
+  if(fda < 0 || fdb < 0){
+    printf("%s: cannot create fraga/fragb\n", s);
+    exit(1);
+  }
+  // interleave the two files' blocks on disk.
+  for(i = 0; i < N; i++){
+    if(write(fda, buf, BSIZE) != BSIZE || write(fdb, buf, BSIZE) != BSIZE){
+      printf("%s: write fraga/fragb failed at block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fda);
+  close(fdb);
+  unlink("fragb");
+
+  fd = open("fragc", O_CREATE|O_WRONLY|O_TRUNC);
+  if(fd < 0){
+    printf("%s: cannot create fragc\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += BUFSZ/BSIZE){
+    for(j = 0; j < BUFSZ; j++)
+      buf[j] = i + j / BSIZE;
+    if(write(fd, buf, BUFSZ) != BUFSZ){
+      printf("%s: write fragc failed at block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("fragc", O_RDONLY);
+  if(fd < 0){
+    printf("%s: cannot open fragc\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += BUFSZ/BSIZE){
+    if(read(fd, buf, BUFSZ) != BUFSZ){
+      printf("%s: read fragc failed at block %d\n", s, i);
+      exit(1);
+    }
+    for(j = 0; j < BUFSZ; j++){
+      if(buf[j] != (char)(i + j / BSIZE)){
+        printf("%s: fragc has wrong contents at block %d\n", s, i + j / BSIZE);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  unlink("fraga");
+  unlink("fragc");
+}
+
 // directory that uses indirect blocks
 void
 bigdir(char *s)
@@ -1963,6 +2111,12 @@ dirfile(char *s)
     printf("%s: chdir dirfile succeeded!\n", s);
     exit(1);
   }
+  // the name cache knows dirfile, but not that it isn't a directory.
+  fd = open("dirfile/.", 0);
+  if(fd >= 0){
+    printf("%s: open dirfile/. succeeded!\n", s);
+    exit(1);
+  }
   fd = open("dirfile/xx", 0);
   if(fd >= 0){
     printf("%s: create dirfile/xx succeeded!\n", s);
@@ -2706,6 +2860,196 @@ execout(char *s)
   exit(0);
 }
 
+// lookups through the name cache must notice unlinks,
+// including names in a directory unlinked while it is the cwd.
+void
+namecache(char *s)
+{
+  int fd;
+
+  if(mkdir("ncdir") < 0 || (fd = open("ncdir/f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create ncdir/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(int i = 0; i < 2; i++){
+    if((fd = open("ncdir/f", O_RDONLY)) < 0){
+      printf("%s: open ncdir/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  if(unlink("ncdir/f") < 0){
+    printf("%s: unlink ncdir/f failed\n", s);
+    exit(1);
+  }
+  if(open("ncdir/f", O_RDONLY) >= 0){
+    printf("%s: open of unlinked ncdir/f succeeded\n", s);
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(chdir("ncdir") < 0 || unlink("../ncdir") < 0){
+      printf("%s: unlink cwd failed\n", s);
+      exit(1);
+    }
+    if((fd = open("g", O_CREATE|O_RDWR)) >= 0){
+      close(fd);
+      close(open("g", O_RDONLY));
+    }
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  // ncdir's inum may be reused; its old names must be gone.
+  if(mkdir("ncdir") < 0){
+    printf("%s: mkdir ncdir failed\n", s);
+    exit(1);
+  }
+  if(open("ncdir/g", O_RDONLY) >= 0){
+    printf("%s: open of stale ncdir/g succeeded\n", s);
+    exit(1);
+  }
+  unlink("ncdir");
+  exit(0);
+}
+
+// threads created with clone() share memory, including
+// memory one of them allocates with sbrk(), and are reaped
+// by join() rather than wait().
+volatile int clonecount[4];
+volatile char *clonemem;
+
+void
+clonechild(void *arg)
+{
+  int i = (int)(uint64)arg;
+
+  for(int j = 0; j < 1000; j++)
+    clonecount[i]++;
+  if(i == 0){
+    char *a = sbrk(4096);
+    if(a == (char*)0xffffffffffffffffL)
+      exit(1);
+    a[0] = 'x';
+    clonemem = a;
+  }
+}
+
+void
+clonetest(char *s)
+{
+  int pids[4];
+
+  for(int i = 0; i < 4; i++){
+    if((pids[i] = thread_create(clonechild, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait() reaped a thread\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 4; i++){
+    int pid = thread_join();
+    int j;
+    for(j = 0; j < 4; j++)
+      if(pids[j] == pid)
+        break;
+    if(j == 4){
+      printf("%s: thread_join returned %d\n", s, pid);
+      exit(1);
+    }
+  }
+  if(thread_join() != -1){
+    printf("%s: thread_join with no threads\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 4; i++){
+    if(clonecount[i] != 1000){
+      printf("%s: thread %d count %d\n", s, i, clonecount[i]);
+      exit(1);
+    }
+  }
+  if(clonemem == 0 || clonemem[0] != 'x'){
+    printf("%s: thread's sbrk() not shared\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// threads contend for a futex-based mutex, and hand
+// items to each other through a condition variable.
+struct mutex futexmu;
+struct cond futexcv;
+int futexsum, futexitems;
+
+void
+futexchild(void *arg)
+{
+  for(int i = 0; i < 2000; i++){
+    mutex_lock(&futexmu);
+    futexsum++;
+    mutex_unlock(&futexmu);
+  }
+  mutex_lock(&futexmu);
+  while(futexitems == 0)
+    cond_wait(&futexcv, &futexmu);
+  futexitems--;
+  mutex_unlock(&futexmu);
+}
+
+void
+futextest(char *s)
+{
+  int x = 1;
+
+  if(futex(&x, FUTEX_WAIT, 2) != -1){
+    printf("%s: FUTEX_WAIT slept though the value differed\n", s);
+    exit(1);
+  }
+  if(futex(&x, FUTEX_WAKE, 1) != 0){
+    printf("%s: FUTEX_WAKE woke a non-waiter\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  for(int i = 0; i < 4; i++){
+    if(thread_create(futexchild, 0) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  sleep(1);
+  for(int i = 0; i < 4; i++){
+    mutex_lock(&futexmu);
+    futexitems++;
+    cond_signal(&futexcv);
+    mutex_unlock(&futexmu);
+  }
+  for(int i = 0; i < 4; i++){
+    if(thread_join() < 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(futexsum != 4*2000 || futexitems != 0){
+    printf("%s: sum %d items %d\n", s, futexsum, futexitems);
+    exit(1);
+  }
+  exit(0);
+}
+
 //
 // use sbrk() to count how many free physical memory pages there are.
 // touches the pages to force allocation.
@@ -2821,6 +3165,9 @@ main(int argc, char *argv[])
     {MAXVAplus, "MAXVAplus"},
     {manywrites, "manywrites"},
     {execout, "execout"},
+    {clonetest, "clonetest"},
+    {namecache, "namecache"},
+    {futextest, "futextest"},
     {copyin, "copyin"},
     {copyout, "copyout"},
     {copyinstr1, "copyinstr1"},
@@ -2865,6 +3212,7 @@ main(int argc, char *argv[])
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
+    {extents, "extents"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
     {exitiputtest, "exitiput"},
@@ -2881,6 +3229,8 @@ main(int argc, char *argv[])
     {iref, "iref"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
+    {bigunlink, "bigunlink"}, // slow
+    {fragwrite, "fragwrite"}, // slow
     { 0, 0},
   };
 
@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("clone");
+entry("join");
+entry("futex");
+entry("lockstat");
+entry("bstat");
+entry("sleepstat");